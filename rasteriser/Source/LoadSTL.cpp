@@ -9,12 +9,13 @@
 
 using namespace std;
 
-// Loads a 3D model stored in STL format as a vector of triangles
+// Loads a 3D model stored in STL format as a vector of triangles. Also used by the raytracer,
+// which passes the path of the file
 
 class LoadSTL
 {
 public:
-	void LoadSTLFile(std::vector<Triangle>& triangles )
+	void LoadSTLFile(std::vector<Triangle>& triangles, const char* path = "Source/enemy1.stl" )
 	{
 		float scale = 0.05f;
 		string line;
@@ -23,7 +24,7 @@ public:
 
 		// Start file stream
 		ifstream inputStream;
-		inputStream.open("Source/enemy1.stl");
+		inputStream.open(path);
 
 		// Clear and reserve triangles
 		triangles.clear();
@@ -0,0 +1,75 @@
+#ifndef AABB_H
+#define AABB_H
+
+// Axis aligned boxes and the ray/box slab test shared by the acceleration structures
+
+#include <glm/glm.hpp>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+// Axis aligned bounding box
+struct AABB
+{
+	glm::vec3 min;
+	glm::vec3 max;
+
+	AABB()
+		: min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()){}
+
+	void Grow( const glm::vec3& p )
+	{
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+
+	void Grow( const AABB& b )
+	{
+		min = glm::min(min, b.min);
+		max = glm::max(max, b.max);
+	}
+
+	float SurfaceArea() const
+	{
+		if(min.x > max.x)
+			return 0.0f;
+		glm::vec3 e = max - min;
+		return 2.0f * (e.x*e.y + e.y*e.z + e.z*e.x);
+	}
+};
+
+// Precomputed per-ray data for the slab test
+struct RayBoxData
+{
+	glm::vec3 origin;
+	glm::vec3 invDir;
+
+	RayBoxData(){}
+
+	RayBoxData( const glm::vec3& start, const glm::vec3& dir )
+		: origin(start)
+	{
+		// Avoid 0 * inf = NaN in the slab test when a direction component is exactly zero
+		for(int a = 0; a < 3; a++)
+		{
+			float d = std::fabs(dir[a]) > 1e-20f ? dir[a] : std::copysign(1e-20f, dir[a]);
+			invDir[a] = 1.0f / d;
+		}
+	}
+};
+
+// Returns the entry distance of the ray into the box, or infinity if it misses or the box is further than tMax
+inline float IntersectAABB( const RayBoxData& ray, const AABB& box, float tMax )
+{
+	glm::vec3 t1 = (box.min - ray.origin) * ray.invDir;
+	glm::vec3 t2 = (box.max - ray.origin) * ray.invDir;
+	glm::vec3 tNear = glm::min(t1, t2);
+	glm::vec3 tFar = glm::max(t1, t2);
+	float tEnter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+	float tExit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, tMax));
+	if(tEnter <= tExit)
+		return tEnter;
+	return std::numeric_limits<float>::max();
+}
+
+#endif
@@ -0,0 +1,610 @@
+#ifndef BVH_H
+#define BVH_H
+
+// Bounding volume hierarchy over the scene triangles. Built top down with a binned
+// surface area heuristic (SAH) and stored as a flat array of nodes so traversal only
+// needs a small stack of node indices. The build runs on every thread: large nodes are
+// binned and partitioned in chunks, and subtrees are handed out as OpenMP tasks.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include "TestModel.h"
+#include "TriangleStore.h"
+#include "AABB.h"
+#include "RayPacket.h"
+
+// Interior nodes store the index of their left child (the right child is stored next to it)
+// and have a count of 0. Leaves store the first entry in the triangle index list and a count.
+struct BVHNode
+{
+	AABB bounds;
+	int leftFirst;
+	int count;
+};
+
+class BVH
+{
+public:
+	std::vector<BVHNode> nodes;
+	std::vector<int> triIndices; // Leaves index into this list, which maps to the scene triangles. The
+								 // triangle store is packed in this order so leaves are contiguous in it
+	int depth;
+	float buildCost; // SAHCost() when the tree was last built
+
+	BVH() : depth(0), buildCost(0.0f){}
+
+	void Build( const std::vector<Triangle>& triangles )
+	{
+		std::vector<AABB> boxes(triangles.size());
+		#pragma omp parallel for schedule(static)
+		for(int i = 0; i < (int)triangles.size(); i++)
+		{
+			boxes[i].Grow(triangles[i].v0);
+			boxes[i].Grow(triangles[i].v1);
+			boxes[i].Grow(triangles[i].v2);
+		}
+		Build(boxes);
+	}
+
+	// Builds over arbitrary primitives given by their bounding boxes. triIndices then maps leaves to box indices
+	void Build( const std::vector<AABB>& boxes )
+	{
+		int n = boxes.size();
+		triIndices.resize(n);
+		centroids.resize(n);
+		scratch.resize(n);
+
+		#pragma omp parallel for schedule(static)
+		for(int i = 0; i < n; i++)
+		{
+			triIndices[i] = i;
+			centroids[i] = (boxes[i].min + boxes[i].max) * 0.5f;
+		}
+
+		// A binary tree with N leaves has 2N - 1 nodes at most. Subtrees built in parallel
+		// take their nodes from a shared counter, and the array is trimmed afterwards
+		nodes.resize(std::max(1, 2*n));
+		nodes[0].leftFirst = 0;
+		nodes[0].count = n;
+		nodeCount = 1;
+
+		// An empty root has a count of 0, which everything walking the tree reads as an interior
+		// node, so the tree stops at the root
+		if(n == 0)
+		{
+			nodes.resize(1);
+			nodes[0].bounds = AABB();
+			centroids.clear();
+			scratch.clear();
+			BuildLevels();
+			depth = 1;
+			buildCost = 0.0f;
+			return;
+		}
+
+		#pragma omp parallel
+		#pragma omp single
+		Subdivide(boxes, 0, 1);
+
+		nodes.resize(nodeCount);
+		centroids.clear();
+		scratch.clear();
+		BuildLevels();
+		depth = levelStart.size() - 1;
+		buildCost = SAHCost();
+	}
+
+	// Groups the nodes by depth for Refit. Build calls this; call it after filling nodes directly
+	void BuildLevels()
+	{
+		levelNodes.clear();
+		levelStart.clear();
+		if(nodes.empty() || triIndices.empty())
+			return;
+
+		levelNodes.push_back(0);
+		int begin = 0;
+		while(begin < (int)levelNodes.size())
+		{
+			int end = levelNodes.size();
+			levelStart.push_back(begin);
+			for(int i = begin; i < end; i++)
+			{
+				const BVHNode& node = nodes[levelNodes[i]];
+				if(node.count == 0)
+				{
+					levelNodes.push_back(node.leftFirst);
+					levelNodes.push_back(node.leftFirst + 1);
+				}
+			}
+			begin = end;
+		}
+		levelStart.push_back(levelNodes.size());
+	}
+
+	// Recomputes the node bounds bottom up after the triangles moved, keeping the tree as it is.
+	// Only for trees built over triangles. Nodes at the same depth don't depend on each other,
+	// so each level is refit in parallel, deepest first.
+	void Refit( const std::vector<Triangle>& triangles )
+	{
+		for(int level = (int)levelStart.size() - 2; level >= 0; level--)
+		{
+			int begin = levelStart[level];
+			int end = levelStart[level + 1];
+
+			#pragma omp parallel for schedule(static) if(end - begin > REFIT_GRAIN)
+			for(int i = begin; i < end; i++)
+			{
+				BVHNode& node = nodes[levelNodes[i]];
+				AABB bounds;
+				if(node.count > 0)
+				{
+					for(int j = node.leftFirst; j < node.leftFirst + node.count; j++)
+					{
+						const Triangle& tri = triangles[triIndices[j]];
+						bounds.Grow(tri.v0);
+						bounds.Grow(tri.v1);
+						bounds.Grow(tri.v2);
+					}
+				}
+				else
+				{
+					bounds = nodes[node.leftFirst].bounds;
+					bounds.Grow(nodes[node.leftFirst + 1].bounds);
+				}
+				node.bounds = bounds;
+			}
+		}
+	}
+
+	// Expected cost of a ray through the tree: the area of every node relative to the root,
+	// weighted by the triangle count for leaves. Refitting keeps the topology, so this grows
+	// as the triangles move away from where the tree was built
+	float SAHCost() const
+	{
+		if(nodes.empty())
+			return 0.0f;
+
+		double cost = 0.0;
+		#pragma omp parallel for schedule(static) reduction(+:cost) if(nodes.size() > REFIT_GRAIN)
+		for(int i = 0; i < (int)nodes.size(); i++)
+			cost += nodes[i].bounds.SurfaceArea() * std::max(nodes[i].count, 1);
+
+		return cost / std::max(nodes[0].bounds.SurfaceArea(), std::numeric_limits<float>::min());
+	}
+
+	// Finds the closest hit with t < hit.t. hit.t should be initialised to the maximum distance.
+	// root can be set to only search a subtree
+	bool Intersect( const TriangleStore& store, const glm::vec3& start, const glm::vec3& dir, Hit& hit, int root = 0 ) const
+	{
+		if(triIndices.empty())
+			return false;
+
+		RayBoxData ray(start, dir);
+		bool found = false;
+
+		int stack[64];
+		int stackSize = 0;
+		int nodeIdx = root;
+
+		if(IntersectAABB(ray, nodes[root].bounds, hit.t) == std::numeric_limits<float>::max())
+			return false;
+
+		while(true)
+		{
+			const BVHNode& node = nodes[nodeIdx];
+			if(node.count > 0)
+			{
+				if(store.IntersectRange(node.leftFirst, node.count, start, dir, hit))
+					found = true;
+			}
+			else
+			{
+				// Visit the nearest child first so the far one can be culled by the updated hit distance
+				int near = node.leftFirst;
+				int far = node.leftFirst + 1;
+				float dNear = IntersectAABB(ray, nodes[near].bounds, hit.t);
+				float dFar = IntersectAABB(ray, nodes[far].bounds, hit.t);
+				if(dFar < dNear)
+				{
+					std::swap(near, far);
+					std::swap(dNear, dFar);
+				}
+
+				if(dNear != std::numeric_limits<float>::max())
+				{
+					if(dFar != std::numeric_limits<float>::max())
+						stack[stackSize++] = far;
+					nodeIdx = near;
+					continue;
+				}
+			}
+
+			// Pop until we find a node that is still closer than the current hit
+			bool next = false;
+			while(stackSize > 0)
+			{
+				nodeIdx = stack[--stackSize];
+				if(IntersectAABB(ray, nodes[nodeIdx].bounds, hit.t) != std::numeric_limits<float>::max())
+				{
+					next = true;
+					break;
+				}
+			}
+			if(!next)
+				break;
+		}
+
+		return found;
+	}
+
+	// Finds the closest hit of every ray in the packet. Each node is fetched once for the whole
+	// packet and only tested from the first ray that still hits it, and nodes outside the packet
+	// frustum are culled with one test. When fewer than MIN_PACKET_RAYS rays are left live in a
+	// subtree the packet has diverged, and those rays finish the subtree one at a time.
+	void IntersectPacket( const TriangleStore& store, RayPacket& packet ) const
+	{
+		if(triIndices.empty() || packet.count == 0)
+			return;
+
+		int stackNode[64];
+		int stackFirst[64];
+		int stackSize = 0;
+		stackNode[stackSize] = 0;
+		stackFirst[stackSize++] = 0;
+
+		while(stackSize > 0)
+		{
+			stackSize--;
+			const BVHNode& node = nodes[stackNode[stackSize]];
+
+			// Rays before first missed an ancestor of this node, so they cannot hit it either
+			int first = packet.FirstHit(node.bounds, stackFirst[stackSize]);
+			if(first == packet.count)
+				continue;
+
+			if(packet.count - first < MIN_PACKET_RAYS)
+			{
+				for(int r = first; r < packet.count; r++)
+					Intersect(store, packet.origin, packet.dir[r], packet.hit[r], stackNode[stackSize]);
+				continue;
+			}
+
+			if(node.count > 0)
+			{
+				for(int r = first; r < packet.count; r++)
+				{
+					if(IntersectAABB(packet.rays[r], node.bounds, packet.hit[r].t) != std::numeric_limits<float>::max())
+						store.IntersectRange(node.leftFirst, node.count, packet.origin, packet.dir[r], packet.hit[r]);
+				}
+			}
+			else
+			{
+				// Order the children by the first live ray and push the far one first
+				int near = node.leftFirst;
+				int far = node.leftFirst + 1;
+				float dNear = IntersectAABB(packet.rays[first], nodes[near].bounds, packet.hit[first].t);
+				float dFar = IntersectAABB(packet.rays[first], nodes[far].bounds, packet.hit[first].t);
+				if(dFar < dNear)
+					std::swap(near, far);
+
+				stackNode[stackSize] = far;
+				stackFirst[stackSize++] = first;
+				stackNode[stackSize] = near;
+				stackFirst[stackSize++] = first;
+			}
+		}
+	}
+
+	// Returns true as soon as any triangle is hit with tMin < t < tMax. Used for shadow rays,
+	// which don't need the closest hit so children are visited in any order
+	bool Occluded( const TriangleStore& store, const glm::vec3& start, const glm::vec3& dir, float tMin, float tMax, int* blocker = 0 ) const
+	{
+		if(triIndices.empty())
+			return false;
+
+		RayBoxData ray(start, dir);
+
+		int stack[64];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while(stackSize > 0)
+		{
+			const BVHNode& node = nodes[stack[--stackSize]];
+			if(IntersectAABB(ray, node.bounds, tMax) == std::numeric_limits<float>::max())
+				continue;
+
+			if(node.count > 0)
+			{
+				if(store.OccludedRange(node.leftFirst, node.count, start, dir, tMin, tMax, blocker))
+					return true;
+			}
+			else
+			{
+				stack[stackSize++] = node.leftFirst + 1;
+				stack[stackSize++] = node.leftFirst;
+			}
+		}
+
+		return false;
+	}
+
+private:
+	static const int SAH_BINS = 16;
+	static const int MAX_LEAF_SIZE = 8;
+	static const int MAX_DEPTH = 60; // Keeps the traversal stack bounded
+	static const int MIN_PACKET_RAYS = 4;
+	static const int REFIT_GRAIN = 256; // Smaller levels are refit on one thread
+	static const int TASK_SIZE = 1024; // Subtrees with more primitives than this are built as tasks
+	static const int CHUNK_SIZE = 16384; // Nodes with more primitives than this are binned and partitioned in chunks in parallel
+	std::vector<glm::vec3> centroids;
+	std::vector<int> scratch; // Partition target for the chunked nodes
+	int nodeCount;
+	std::vector<int> levelNodes; // Node indices sorted by depth, root first
+	std::vector<int> levelStart; // Where each depth starts in levelNodes, plus the end
+
+	// Primitive counts and bounds of the SAH bins on each axis
+	struct Bins
+	{
+		AABB bounds[3][SAH_BINS];
+		int counts[3][SAH_BINS];
+
+		Bins()
+		{
+			for(int axis = 0; axis < 3; axis++)
+				std::fill(counts[axis], counts[axis] + SAH_BINS, 0);
+		}
+
+		void Add( const Bins& other )
+		{
+			for(int axis = 0; axis < 3; axis++)
+			{
+				for(int b = 0; b < SAH_BINS; b++)
+				{
+					counts[axis][b] += other.counts[axis][b];
+					bounds[axis][b].Grow(other.bounds[axis][b]);
+				}
+			}
+		}
+	};
+
+	// Returns the index of the first node of a new pair of siblings
+	int AllocatePair()
+	{
+		int idx;
+		#pragma omp atomic capture
+		{ idx = nodeCount; nodeCount += 2; }
+		return idx;
+	}
+
+	int BinIndex( int prim, int axis, const AABB& centroidBounds, float scale ) const
+	{
+		return std::min(SAH_BINS - 1, (int)((centroids[prim][axis] - centroidBounds.min[axis]) * scale));
+	}
+
+	void RangeBounds( const std::vector<AABB>& boxes, int begin, int end, AABB& bounds, AABB& centroidBounds ) const
+	{
+		for(int i = begin; i < end; i++)
+		{
+			bounds.Grow(boxes[triIndices[i]]);
+			centroidBounds.Grow(centroids[triIndices[i]]);
+		}
+	}
+
+	void BinRange( const std::vector<AABB>& boxes, int begin, int end, const AABB& centroidBounds, const float scale[3], Bins& bins ) const
+	{
+		for(int axis = 0; axis < 3; axis++)
+		{
+			if(scale[axis] == 0.0f)
+				continue;
+			for(int i = begin; i < end; i++)
+			{
+				int bin = BinIndex(triIndices[i], axis, centroidBounds, scale[axis]);
+				bins.counts[axis][bin]++;
+				bins.bounds[axis][bin].Grow(boxes[triIndices[i]]);
+			}
+		}
+	}
+
+	// Stable partition of [first, first+count) through scratch. Every chunk counts its left side,
+	// a prefix sum over the chunks gives where each one writes, and the chunks scatter in parallel.
+	// Returns the first primitive on the right side
+	int ParallelPartition( int first, int count, int axis, int split, const AABB& centroidBounds, float scale )
+	{
+		int chunks = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		std::vector<int> leftCounts(chunks);
+
+		#pragma omp taskloop shared(leftCounts)
+		for(int c = 0; c < chunks; c++)
+		{
+			int end = std::min(first + count, first + (c + 1) * CHUNK_SIZE);
+			int left = 0;
+			for(int i = first + c * CHUNK_SIZE; i < end; i++)
+			{
+				if(BinIndex(triIndices[i], axis, centroidBounds, scale) <= split)
+					left++;
+			}
+			leftCounts[c] = left;
+		}
+
+		std::vector<int> leftStart(chunks), rightStart(chunks);
+		int leftTotal = 0;
+		for(int c = 0; c < chunks; c++)
+		{
+			leftStart[c] = leftTotal;
+			leftTotal += leftCounts[c];
+		}
+		int rightTotal = 0;
+		for(int c = 0; c < chunks; c++)
+		{
+			rightStart[c] = leftTotal + rightTotal;
+			rightTotal += std::min(CHUNK_SIZE, count - c * CHUNK_SIZE) - leftCounts[c];
+		}
+
+		#pragma omp taskloop shared(leftStart, rightStart)
+		for(int c = 0; c < chunks; c++)
+		{
+			int end = std::min(first + count, first + (c + 1) * CHUNK_SIZE);
+			int left = first + leftStart[c];
+			int right = first + rightStart[c];
+			for(int i = first + c * CHUNK_SIZE; i < end; i++)
+			{
+				if(BinIndex(triIndices[i], axis, centroidBounds, scale) <= split)
+					scratch[left++] = triIndices[i];
+				else
+					scratch[right++] = triIndices[i];
+			}
+		}
+
+		#pragma omp taskloop
+		for(int c = 0; c < chunks; c++)
+		{
+			int end = std::min(first + count, first + (c + 1) * CHUNK_SIZE);
+			std::copy(scratch.begin() + first + c * CHUNK_SIZE, scratch.begin() + end, triIndices.begin() + first + c * CHUNK_SIZE);
+		}
+
+		return first + leftTotal;
+	}
+
+	void Subdivide( const std::vector<AABB>& boxes, int nodeIdx, int nodeDepth )
+	{
+		int first = nodes[nodeIdx].leftFirst;
+		int count = nodes[nodeIdx].count;
+		int chunks = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+		// Bounds of the node and of the triangle centroids, which are what we split on
+		AABB bounds, centroidBounds;
+		if(chunks > 1)
+		{
+			std::vector<AABB> chunkBounds(chunks), chunkCentroids(chunks);
+			#pragma omp taskloop shared(boxes, chunkBounds, chunkCentroids)
+			for(int c = 0; c < chunks; c++)
+				RangeBounds(boxes, first + c * CHUNK_SIZE, std::min(first + count, first + (c + 1) * CHUNK_SIZE), chunkBounds[c], chunkCentroids[c]);
+			for(int c = 0; c < chunks; c++)
+			{
+				bounds.Grow(chunkBounds[c]);
+				centroidBounds.Grow(chunkCentroids[c]);
+			}
+		}
+		else
+			RangeBounds(boxes, first, first + count, bounds, centroidBounds);
+		nodes[nodeIdx].bounds = bounds;
+
+		if(count <= 2 || nodeDepth >= MAX_DEPTH)
+			return;
+
+		// Bin along every axis with some centroid extent
+		float scale[3];
+		for(int axis = 0; axis < 3; axis++)
+		{
+			float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+			scale[axis] = (extent > 0.0f) ? SAH_BINS / extent : 0.0f;
+		}
+
+		Bins bins;
+		if(chunks > 1)
+		{
+			std::vector<Bins> chunkBins(chunks);
+			#pragma omp taskloop shared(boxes, centroidBounds, scale, chunkBins)
+			for(int c = 0; c < chunks; c++)
+				BinRange(boxes, first + c * CHUNK_SIZE, std::min(first + count, first + (c + 1) * CHUNK_SIZE), centroidBounds, scale, chunkBins[c]);
+			for(int c = 0; c < chunks; c++)
+				bins.Add(chunkBins[c]);
+		}
+		else
+			BinRange(boxes, first, first + count, centroidBounds, scale, bins);
+
+		// Evaluate the SAH at the bin boundaries of every axis
+		int bestAxis = -1;
+		int bestSplit = 0;
+		float bestCost = std::numeric_limits<float>::max();
+
+		for(int axis = 0; axis < 3; axis++)
+		{
+			if(scale[axis] == 0.0f)
+				continue;
+
+			// Sweep from both sides to get the area and count left and right of each plane
+			float leftArea[SAH_BINS - 1], rightArea[SAH_BINS - 1];
+			int leftCount[SAH_BINS - 1], rightCount[SAH_BINS - 1];
+			AABB leftBox, rightBox;
+			int leftSum = 0, rightSum = 0;
+			for(int i = 0; i < SAH_BINS - 1; i++)
+			{
+				leftSum += bins.counts[axis][i];
+				leftBox.Grow(bins.bounds[axis][i]);
+				leftCount[i] = leftSum;
+				leftArea[i] = leftBox.SurfaceArea();
+
+				rightSum += bins.counts[axis][SAH_BINS - 1 - i];
+				rightBox.Grow(bins.bounds[axis][SAH_BINS - 1 - i]);
+				rightCount[SAH_BINS - 2 - i] = rightSum;
+				rightArea[SAH_BINS - 2 - i] = rightBox.SurfaceArea();
+			}
+
+			for(int i = 0; i < SAH_BINS - 1; i++)
+			{
+				if(leftCount[i] == 0 || rightCount[i] == 0)
+					continue;
+				float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+				if(cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+
+		// Compare against the cost of leaving this node as a leaf
+		float leafCost = count * bounds.SurfaceArea();
+		if(bestAxis == -1 || (bestCost >= leafCost && count <= MAX_LEAF_SIZE))
+			return;
+
+		// Partition the index list around the chosen bin boundary
+		int i;
+		if(chunks > 1)
+			i = ParallelPartition(first, count, bestAxis, bestSplit, centroidBounds, scale[bestAxis]);
+		else
+		{
+			i = first;
+			int j = first + count - 1;
+			while(i <= j)
+			{
+				if(BinIndex(triIndices[i], bestAxis, centroidBounds, scale[bestAxis]) <= bestSplit)
+					i++;
+				else
+					std::swap(triIndices[i], triIndices[j--]);
+			}
+		}
+
+		int leftCount = i - first;
+		if(leftCount == 0 || leftCount == count)
+			return;
+
+		int leftIdx = AllocatePair();
+		nodes[leftIdx].leftFirst = first;
+		nodes[leftIdx].count = leftCount;
+		nodes[leftIdx + 1].leftFirst = i;
+		nodes[leftIdx + 1].count = count - leftCount;
+
+		nodes[nodeIdx].leftFirst = leftIdx;
+		nodes[nodeIdx].count = 0;
+
+		// Large subtrees are left for idle threads to pick up
+		if(count > TASK_SIZE)
+		{
+			#pragma omp task shared(boxes)
+			Subdivide(boxes, leftIdx, nodeDepth + 1);
+		}
+		else
+			Subdivide(boxes, leftIdx, nodeDepth + 1);
+		Subdivide(boxes, leftIdx + 1, nodeDepth + 1);
+	}
+};
+
+#endif
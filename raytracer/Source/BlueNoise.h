@@ -0,0 +1,163 @@
+#ifndef BLUE_NOISE_H
+#define BLUE_NOISE_H
+
+// Tileable blue noise mask made with the void and cluster method. Every value from 0 to 1 appears
+// once, and pixels with close values are spread out over the tile, so noise driven by the mask
+// has little low frequency content and reads as fine grain instead of blotches. Each pixel is
+// ranked in turn: the densest cluster is taken out of a starting pattern to rank the values
+// below it, then the largest void is filled to rank the rest. Density is measured with a
+// Gaussian that wraps around the edges, so the tile repeats without seams.
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+class BlueNoise
+{
+public:
+	static const int SIZE = 64; // Side of the tile, a power of two
+
+	std::vector<float> values; // Row by row, in [0,1)
+
+	void Generate( uint32_t seed )
+	{
+		const int N = SIZE * SIZE;
+
+		// Energy contributed by a set pixel to one dx,dy away
+		kernel.resize((2*RADIUS + 1) * (2*RADIUS + 1));
+		for(int dy = -RADIUS; dy <= RADIUS; dy++)
+		{
+			for(int dx = -RADIUS; dx <= RADIUS; dx++)
+				kernel[(dy + RADIUS)*(2*RADIUS + 1) + dx + RADIUS] = expf(-(dx*dx + dy*dy) / (2.0f * SIGMA * SIGMA));
+		}
+
+		// Start from a tenth of the pixels set at random, then move the tightest cluster into
+		// the largest void until that would put it straight back
+		set.assign(N, 0);
+		energy.assign(N, 0.0f);
+		rowMin.resize(SIZE);
+		rowMax.resize(SIZE);
+		for(int y = 0; y < SIZE; y++)
+			UpdateRow(y);
+		int ones = 0;
+		while(ones < N / 10)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			int p = (seed >> 8) % N;
+			if(!set[p])
+			{
+				Toggle(p);
+				ones++;
+			}
+		}
+		for(int i = 0; i < N; i++)
+		{
+			int cluster = TightestCluster();
+			Toggle(cluster);
+			int gap = LargestVoid();
+			if(gap == cluster)
+			{
+				Toggle(cluster);
+				break;
+			}
+			Toggle(gap);
+		}
+		std::vector<unsigned char> initial = set;
+		std::vector<float> initialEnergy = energy;
+		std::vector<int> initialMin = rowMin, initialMax = rowMax;
+
+		std::vector<int> rank(N);
+		for(int r = ones - 1; r >= 0; r--)
+		{
+			int cluster = TightestCluster();
+			Toggle(cluster);
+			rank[cluster] = r;
+		}
+
+		set = initial;
+		energy = initialEnergy;
+		rowMin = initialMin;
+		rowMax = initialMax;
+		for(int r = ones; r < N; r++)
+		{
+			int gap = LargestVoid();
+			Toggle(gap);
+			rank[gap] = r;
+		}
+
+		values.resize(N);
+		for(int p = 0; p < N; p++)
+			values[p] = (rank[p] + 0.5f) / N;
+
+		kernel.clear();
+		set.clear();
+		energy.clear();
+		rowMin.clear();
+		rowMax.clear();
+	}
+
+	// Wraps around the tile in both directions
+	float At( int x, int y ) const
+	{
+		return values[(y & (SIZE - 1))*SIZE + (x & (SIZE - 1))];
+	}
+
+private:
+	static constexpr float SIGMA = 1.5f;
+	static constexpr float SET_OFFSET = 100.0f; // Far above the energy any pixel can have, about 2 pi SIGMA^2
+	static const int RADIUS = 6; // The Gaussian is below 1e-3 of its peak further out, so it is cut off there
+
+	std::vector<float> kernel;
+	std::vector<unsigned char> set; // Whether each pixel is in the pattern
+	std::vector<float> energy; // Plus SET_OFFSET on set pixels, so one search finds either extreme
+	std::vector<int> rowMin, rowMax; // Pixels with the least and most energy in each row
+
+	void Toggle( int p )
+	{
+		set[p] = !set[p];
+		float sign = set[p] ? 1.0f : -1.0f;
+		energy[p] += sign * SET_OFFSET;
+		int px = p % SIZE, py = p / SIZE;
+		for(int dy = -RADIUS; dy <= RADIUS; dy++)
+		{
+			int y = (py + dy) & (SIZE - 1);
+			for(int dx = -RADIUS; dx <= RADIUS; dx++)
+				energy[y*SIZE + ((px + dx) & (SIZE - 1))] += sign * kernel[(dy + RADIUS)*(2*RADIUS + 1) + dx + RADIUS];
+			UpdateRow(y);
+		}
+	}
+
+	// The set pixel with the most energy around it. Set pixels are offset above every unset one
+	int TightestCluster() const
+	{
+		int best = rowMax[0];
+		for(int y = 1; y < SIZE; y++)
+		{
+			if(energy[rowMax[y]] > energy[best])
+				best = rowMax[y];
+		}
+		return best;
+	}
+
+	// The unset pixel with the least energy around it
+	int LargestVoid() const
+	{
+		int best = rowMin[0];
+		for(int y = 1; y < SIZE; y++)
+		{
+			if(energy[rowMin[y]] < energy[best])
+				best = rowMin[y];
+		}
+		return best;
+	}
+
+	void UpdateRow( int y )
+	{
+		const float* row = &energy[y*SIZE];
+		rowMin[y] = y*SIZE + (std::min_element(row, row + SIZE) - row);
+		rowMax[y] = y*SIZE + (std::max_element(row, row + SIZE) - row);
+	}
+};
+
+#endif
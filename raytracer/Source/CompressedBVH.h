@@ -0,0 +1,283 @@
+#ifndef COMPRESSED_BVH_H
+#define COMPRESSED_BVH_H
+
+// 4-wide BVH with quantised child bounds. Each node stores its own box as an origin and a
+// power of two cell size per axis, and the four child boxes as 8 bit cell coordinates on that
+// grid, rounded outwards so they always contain the real boxes. A node fits in one 64 byte
+// cache line, half the size of a WideBVHNode. Traversal decodes the boxes back to floats
+// before the same SSE slab test, so it trades a few instructions per node for memory bandwidth.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include "AABB.h"
+#include "WideBVH.h"
+#include "TriangleStore.h"
+
+#if SIMD_WIDTH > 1
+	#include <emmintrin.h>
+#endif
+#ifdef __SSE4_1__
+	#include <smmintrin.h>
+#endif
+
+struct alignas(64) CompressedBVHNode
+{
+	static const unsigned short EMPTY = 0xffff;
+	static const int MAX_LEAF_SIZE = EMPTY - 1;
+
+	float originX, originY, originZ; // Minimum corner of the node's box
+	signed char exponent[3];         // Cell size on each axis is 2^exponent
+	unsigned char pad;
+	unsigned char qminX[4], qminY[4], qminZ[4];
+	unsigned char qmaxX[4], qmaxY[4], qmaxZ[4];
+	int child[4];                    // Child node, or first triangle in the store for leaves
+	unsigned short count[4];         // 0 for interior children, number of triangles for leaves, EMPTY for unused slots
+};
+
+static_assert(sizeof(CompressedBVHNode) == 64, "CompressedBVHNode should fill one cache line");
+
+class CompressedBVH
+{
+public:
+	std::vector<CompressedBVHNode> nodes; // Same indices as the WideBVH nodes they were compressed from
+	AABB rootBounds;
+
+	// Quantises the child boxes of every wide node. Returns false, leaving the structure empty,
+	// if a leaf is too big for the 16 bit triangle count
+	bool Build( const WideBVH& wide )
+	{
+		nodes.clear();
+		if(wide.nodes.empty())
+			return true;
+
+		rootBounds = wide.rootBounds;
+		nodes.resize(wide.nodes.size());
+		bool ok = true;
+
+		#pragma omp parallel for schedule(static) reduction(&&:ok)
+		for(int n = 0; n < (int)wide.nodes.size(); n++)
+			ok = Compress(wide.nodes[n], nodes[n]) && ok;
+
+		if(!ok)
+			nodes.clear();
+		return ok;
+	}
+
+	// Finds the closest hit with t < hit.t. hit.t should be initialised to the maximum distance.
+	bool Intersect( const TriangleStore& store, const glm::vec3& start, const glm::vec3& dir, Hit& hit ) const
+	{
+		if(nodes.empty())
+			return false;
+
+		RayBoxData ray(start, dir);
+		if(IntersectAABB(ray, rootBounds, hit.t) == std::numeric_limits<float>::max())
+			return false;
+
+		SlabRay slab(ray);
+		bool found = false;
+
+		int stack[64 * 3];
+		float stackDist[64 * 3];
+		int stackSize = 0;
+		stack[stackSize] = 0;
+		stackDist[stackSize++] = 0.0f;
+
+		while(stackSize > 0)
+		{
+			stackSize--;
+			if(stackDist[stackSize] >= hit.t)
+				continue;
+
+			int entry = stack[stackSize];
+			if(entry < 0)
+			{
+				int leaf = entry & 0x7fffffff;
+				const CompressedBVHNode& node = nodes[leaf >> 2];
+				if(store.IntersectRange(node.child[leaf & 3], node.count[leaf & 3], start, dir, hit))
+					found = true;
+				continue;
+			}
+
+			float dist[4];
+			int mask = IntersectChildren(nodes[entry], slab, hit.t, dist);
+			PushOrdered4(nodes[entry], entry, mask, dist, stack, stackDist, stackSize);
+		}
+
+		return found;
+	}
+
+	// Returns true as soon as any triangle is hit with tMin < t < tMax
+	bool Occluded( const TriangleStore& store, const glm::vec3& start, const glm::vec3& dir, float tMin, float tMax, int* blocker = 0 ) const
+	{
+		if(nodes.empty())
+			return false;
+
+		RayBoxData ray(start, dir);
+		if(IntersectAABB(ray, rootBounds, tMax) == std::numeric_limits<float>::max())
+			return false;
+
+		SlabRay slab(ray);
+		int stack[64 * 3];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while(stackSize > 0)
+		{
+			const CompressedBVHNode& node = nodes[stack[--stackSize]];
+			float dist[4];
+			int mask = IntersectChildren(node, slab, tMax, dist);
+			for(int i = 0; i < 4; i++)
+			{
+				if(!(mask & (1 << i)))
+					continue;
+				if(node.count[i] > 0)
+				{
+					if(store.OccludedRange(node.child[i], node.count[i], start, dir, tMin, tMax, blocker))
+						return true;
+				}
+				else
+					stack[stackSize++] = node.child[i];
+			}
+		}
+
+		return false;
+	}
+
+private:
+#if SIMD_WIDTH > 1
+	// Widens four 8 bit cell coordinates to floats
+	static __m128 Widen( const unsigned char q[4] )
+	{
+#ifdef __SSE4_1__
+		int packed;
+		memcpy(&packed, q, 4);
+		return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+#else
+		return _mm_set_ps(q[3], q[2], q[1], q[0]);
+#endif
+	}
+
+	// 2^exponent built straight from the float exponent bits
+	static __m128 CellSize( int exponent )
+	{
+		return _mm_castsi128_ps(_mm_set1_epi32((exponent + 127) << 23));
+	}
+
+	// Decodes the child boxes and runs the slab test on them. Empty slots never count as hit
+	static int IntersectChildren( const CompressedBVHNode& node, const SlabRay& ray, float tMax, float dist[4] )
+	{
+		__m128 ox = _mm_set1_ps(node.originX);
+		__m128 oy = _mm_set1_ps(node.originY);
+		__m128 oz = _mm_set1_ps(node.originZ);
+		__m128 sx = CellSize(node.exponent[0]);
+		__m128 sy = CellSize(node.exponent[1]);
+		__m128 sz = CellSize(node.exponent[2]);
+
+		int mask = IntersectBoxes4(_mm_add_ps(ox, _mm_mul_ps(Widen(node.qminX), sx)),
+								   _mm_add_ps(oy, _mm_mul_ps(Widen(node.qminY), sy)),
+								   _mm_add_ps(oz, _mm_mul_ps(Widen(node.qminZ), sz)),
+								   _mm_add_ps(ox, _mm_mul_ps(Widen(node.qmaxX), sx)),
+								   _mm_add_ps(oy, _mm_mul_ps(Widen(node.qmaxY), sy)),
+								   _mm_add_ps(oz, _mm_mul_ps(Widen(node.qmaxZ), sz)), ray, tMax, dist);
+#else
+	// Decodes the child boxes one slot at a time and runs the scalar slab test on them. Empty
+	// slots never count as hit
+	static int IntersectChildren( const CompressedBVHNode& node, const SlabRay& ray, float tMax, float dist[4] )
+	{
+		float sx = ldexpf(1.0f, node.exponent[0]);
+		float sy = ldexpf(1.0f, node.exponent[1]);
+		float sz = ldexpf(1.0f, node.exponent[2]);
+
+		float minX[4], minY[4], minZ[4], maxX[4], maxY[4], maxZ[4];
+		for(int i = 0; i < 4; i++)
+		{
+			minX[i] = node.originX + node.qminX[i] * sx;
+			minY[i] = node.originY + node.qminY[i] * sy;
+			minZ[i] = node.originZ + node.qminZ[i] * sz;
+			maxX[i] = node.originX + node.qmaxX[i] * sx;
+			maxY[i] = node.originY + node.qmaxY[i] * sy;
+			maxZ[i] = node.originZ + node.qmaxZ[i] * sz;
+		}
+
+		int mask = IntersectBoxes4(minX, minY, minZ, maxX, maxY, maxZ, ray, tMax, dist);
+#endif
+		for(int i = 0; i < 4; i++)
+		{
+			if(node.count[i] == CompressedBVHNode::EMPTY)
+				mask &= ~(1 << i);
+		}
+		return mask;
+	}
+
+	// Smallest power of two exponent whose 255 cells cover [origin, max] once rounded to floats
+	static int ChooseExponent( float origin, float max )
+	{
+		int exponent;
+		frexp(std::max(max - origin, std::numeric_limits<float>::min()) / 255.0f, &exponent);
+		exponent = std::max(exponent, -126);
+		while(origin + 255.0f * ldexpf(1.0f, exponent) < max)
+			exponent++;
+		return exponent;
+	}
+
+	// Cell coordinates of [lo, hi] on the grid, rounded outwards so the decoded box contains it
+	static void Quantise( float origin, int exponent, float lo, float hi, unsigned char& qlo, unsigned char& qhi )
+	{
+		float cell = ldexpf(1.0f, exponent);
+		int a = std::min(255, std::max(0, (int)floorf((lo - origin) / cell)));
+		int b = std::min(255, std::max(0, (int)ceilf((hi - origin) / cell)));
+		while(a > 0 && origin + a * cell > lo)
+			a--;
+		while(b < 255 && origin + b * cell < hi)
+			b++;
+		qlo = a;
+		qhi = b;
+	}
+
+	static bool Compress( const WideBVHNode& wide, CompressedBVHNode& node )
+	{
+		AABB bounds;
+		for(int i = 0; i < 4; i++)
+		{
+			if(wide.count[i] >= 0)
+				bounds.Grow(wide.ChildBounds(i));
+		}
+
+		node.originX = bounds.min.x;
+		node.originY = bounds.min.y;
+		node.originZ = bounds.min.z;
+		node.pad = 0;
+		int exponent[3];
+		for(int axis = 0; axis < 3; axis++)
+		{
+			exponent[axis] = ChooseExponent(bounds.min[axis], bounds.max[axis]);
+			node.exponent[axis] = exponent[axis];
+		}
+
+		bool ok = true;
+		for(int i = 0; i < 4; i++)
+		{
+			node.child[i] = wide.child[i];
+			if(wide.count[i] < 0)
+			{
+				node.count[i] = CompressedBVHNode::EMPTY;
+				node.qminX[i] = node.qminY[i] = node.qminZ[i] = 0;
+				node.qmaxX[i] = node.qmaxY[i] = node.qmaxZ[i] = 0;
+				continue;
+			}
+			if(wide.count[i] > CompressedBVHNode::MAX_LEAF_SIZE)
+				ok = false;
+			node.count[i] = wide.count[i];
+
+			Quantise(node.originX, exponent[0], wide.minX[i], wide.maxX[i], node.qminX[i], node.qmaxX[i]);
+			Quantise(node.originY, exponent[1], wide.minY[i], wide.maxY[i], node.qminY[i], node.qmaxY[i]);
+			Quantise(node.originZ, exponent[2], wide.minZ[i], wide.maxZ[i], node.qminZ[i], node.qmaxZ[i]);
+		}
+		return ok;
+	}
+};
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef GRID_H
+#define GRID_H
+
+// Uniform grid over the scene triangles, traversed cell by cell along the ray with a 3D-DDA.
+// Building is a couple of linear passes with no sorting or splitting, so it can be redone
+// every frame when the triangles move. Each triangle is referenced by every cell its bounding
+// box overlaps, and the grid packs its own copy of the triangles cell by cell so a cell is one
+// contiguous range in the triangle store.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include "TestModel.h"
+#include "AABB.h"
+#include "TriangleStore.h"
+
+class Grid
+{
+public:
+	AABB bounds;
+	glm::ivec3 res;             // Cells along each axis
+	glm::vec3 cellSize;
+	std::vector<int> cellStart; // First store entry of each cell, plus the end of the last cell
+	TriangleStore store;        // Triangles packed cell by cell
+
+	Grid() : res(0){}
+
+	void Build( const std::vector<Triangle>& triangles )
+	{
+		bounds = AABB();
+		cellStart.clear();
+		res = glm::ivec3(0);
+		if(triangles.empty())
+		{
+			store.Build(triangles, std::vector<int>());
+			return;
+		}
+
+		std::vector<AABB> boxes(triangles.size());
+		for(size_t i = 0; i < triangles.size(); i++)
+		{
+			boxes[i].Grow(triangles[i].v0);
+			boxes[i].Grow(triangles[i].v1);
+			boxes[i].Grow(triangles[i].v2);
+			bounds.Grow(boxes[i]);
+		}
+
+		// Pad flat scenes so every axis has some thickness
+		glm::vec3 extent = bounds.max - bounds.min;
+		float pad = std::max(std::max(extent.x, extent.y), extent.z) * 1e-3f + 1e-6f;
+		bounds.min -= glm::vec3(pad);
+		bounds.max += glm::vec3(pad);
+		extent = bounds.max - bounds.min;
+
+		// Aim for about DENSITY triangles per cell, with cube shaped cells
+		float cellsPerUnit = cbrtf((float) DENSITY * triangles.size() / (extent.x * extent.y * extent.z));
+		for(int axis = 0; axis < 3; axis++)
+			res[axis] = std::min(MAX_RES, std::max(1, (int)(extent[axis] * cellsPerUnit)));
+		cellSize = extent / glm::vec3(res);
+		int cells = res.x * res.y * res.z;
+
+		// Count the references per cell, turn the counts into offsets, then fill them in
+		std::vector<int> counts(cells + 1, 0);
+		for(size_t i = 0; i < boxes.size(); i++)
+		{
+			glm::ivec3 lo = CellOf(boxes[i].min);
+			glm::ivec3 hi = CellOf(boxes[i].max);
+			for(int z = lo.z; z <= hi.z; z++)
+				for(int y = lo.y; y <= hi.y; y++)
+					for(int x = lo.x; x <= hi.x; x++)
+						counts[CellIndex(x, y, z)]++;
+		}
+
+		cellStart.assign(cells + 1, 0);
+		for(int c = 0; c < cells; c++)
+			cellStart[c + 1] = cellStart[c] + counts[c];
+
+		std::vector<int> refs(cellStart[cells]);
+		std::copy(cellStart.begin(), cellStart.end() - 1, counts.begin());
+		for(size_t i = 0; i < boxes.size(); i++)
+		{
+			glm::ivec3 lo = CellOf(boxes[i].min);
+			glm::ivec3 hi = CellOf(boxes[i].max);
+			for(int z = lo.z; z <= hi.z; z++)
+				for(int y = lo.y; y <= hi.y; y++)
+					for(int x = lo.x; x <= hi.x; x++)
+						refs[counts[CellIndex(x, y, z)]++] = i;
+		}
+
+		store.Build(triangles, refs);
+	}
+
+	// Finds the closest hit with t < hit.t. hit.t should be initialised to the maximum distance.
+	bool Intersect( const glm::vec3& start, const glm::vec3& dir, Hit& hit ) const
+	{
+		Walker walk;
+		if(cellStart.empty() || !walk.Begin(*this, start, dir, hit.t))
+			return false;
+
+		bool found = false;
+		while(true)
+		{
+			int c = walk.Cell();
+			if(store.IntersectRange(cellStart[c], cellStart[c+1] - cellStart[c], start, dir, hit))
+				found = true;
+
+			// A hit inside this cell can't be beaten by a later one. A hit further on, in a
+			// triangle that also overlaps later cells, still has to be checked against them
+			if(hit.t <= walk.Exit() || !walk.Next())
+				break;
+		}
+		return found;
+	}
+
+	// Returns true as soon as any triangle is hit with tMin < t < tMax
+	bool Occluded( const glm::vec3& start, const glm::vec3& dir, float tMin, float tMax, int* blocker = 0 ) const
+	{
+		Walker walk;
+		if(cellStart.empty() || !walk.Begin(*this, start, dir, tMax))
+			return false;
+
+		while(true)
+		{
+			int c = walk.Cell();
+			if(store.OccludedRange(cellStart[c], cellStart[c+1] - cellStart[c], start, dir, tMin, tMax, blocker))
+				return true;
+			if(walk.Exit() >= tMax || !walk.Next())
+				return false;
+		}
+	}
+
+	int References() const
+	{
+		return store.count;
+	}
+
+private:
+	static const int MAX_RES = 256;
+	static const int DENSITY = 2; // Target triangles per cell
+
+	glm::ivec3 CellOf( const glm::vec3& p ) const
+	{
+		glm::ivec3 cell;
+		for(int axis = 0; axis < 3; axis++)
+			cell[axis] = std::min(res[axis] - 1, std::max(0, (int)((p[axis] - bounds.min[axis]) / cellSize[axis])));
+		return cell;
+	}
+
+	int CellIndex( int x, int y, int z ) const
+	{
+		return x + res.x * (y + res.y * z);
+	}
+
+	// Steps a ray from cell to cell in the order it passes through them (Amanatides and Woo)
+	struct Walker
+	{
+		glm::ivec3 cell, step, end;
+		glm::vec3 tNext;  // Distance to the next cell boundary on each axis
+		glm::vec3 tDelta; // Distance between boundaries on each axis
+		int index, stride[3];
+
+		bool Begin( const Grid& grid, const glm::vec3& start, const glm::vec3& dir, float tMax )
+		{
+			RayBoxData ray(start, dir);
+			float tEnter = IntersectAABB(ray, grid.bounds, tMax);
+			if(tEnter == std::numeric_limits<float>::max())
+				return false;
+
+			cell = grid.CellOf(start + dir * tEnter);
+			stride[0] = 1;
+			stride[1] = grid.res.x;
+			stride[2] = grid.res.x * grid.res.y;
+			index = grid.CellIndex(cell.x, cell.y, cell.z);
+
+			for(int axis = 0; axis < 3; axis++)
+			{
+				// RayBoxData never has a zero inverse direction, so every axis gets a finite step
+				bool positive = ray.invDir[axis] > 0.0f;
+				step[axis] = positive ? 1 : -1;
+				end[axis] = positive ? grid.res[axis] : -1;
+				float boundary = grid.bounds.min[axis] + (cell[axis] + (positive ? 1 : 0)) * grid.cellSize[axis];
+				tNext[axis] = (boundary - start[axis]) * ray.invDir[axis];
+				tDelta[axis] = grid.cellSize[axis] * fabsf(ray.invDir[axis]);
+			}
+			return true;
+		}
+
+		int Cell() const
+		{
+			return index;
+		}
+
+		// Distance at which the ray leaves the current cell
+		float Exit() const
+		{
+			return std::min(std::min(tNext.x, tNext.y), tNext.z);
+		}
+
+		// Moves to the next cell. Returns false once the ray leaves the grid
+		bool Next()
+		{
+			int axis = (tNext.x < tNext.y) ? (tNext.x < tNext.z ? 0 : 2) : (tNext.y < tNext.z ? 1 : 2);
+			cell[axis] += step[axis];
+			if(cell[axis] == end[axis])
+				return false;
+			index += step[axis] * stride[axis];
+			tNext[axis] += tDelta[axis];
+			return true;
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef INSTANCING_H
+#define INSTANCING_H
+
+// Two-level acceleration structure. Each unique mesh is built once into its own bottom-level
+// BVH and triangle store, and instances place a mesh in the world with a transform. A top-level
+// BVH over the instance bounds finds which instances a ray passes through, and the ray is moved
+// into the instance's object space to traverse the shared mesh. Memory grows with the number of
+// unique meshes; an extra instance only costs a transform and a box.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include "TestModel.h"
+#include "AABB.h"
+#include "BVH.h"
+#include "TriangleStore.h"
+
+// Geometry shared by every instance that references it
+struct Mesh
+{
+	std::vector<Triangle> triangles;
+	BVH bvh;
+	TriangleStore store;
+	AABB bounds;
+
+	void Build()
+	{
+		bvh.Build(triangles);
+		store.Build(triangles, bvh.triIndices);
+		bounds = bvh.nodes.empty() ? AABB() : bvh.nodes[0].bounds;
+	}
+
+	size_t MemoryUsage() const
+	{
+		return triangles.size() * sizeof(Triangle) + bvh.nodes.size() * sizeof(BVHNode) + bvh.triIndices.size() * sizeof(int)
+			+ (store.count + SIMD_WIDTH) * (12 * sizeof(float) + sizeof(int));
+	}
+};
+
+struct Instance
+{
+	int mesh;
+	glm::mat4 transform;     // Object to world
+	glm::mat4 inverse;       // World to object, used to move rays into object space
+	glm::mat3 normalMatrix;  // Inverse transpose of the upper 3x3, for world space normals
+	AABB bounds;             // World space bounds of the transformed mesh
+};
+
+class TwoLevelBVH
+{
+public:
+	std::vector<Mesh> meshes;
+	std::vector<Instance> instances;
+	BVH top; // Leaves index instances through top.triIndices
+
+	// Adds a mesh and returns its index for AddInstance. The mesh's BVH is built here
+	int AddMesh( const std::vector<Triangle>& triangles )
+	{
+		meshes.push_back(Mesh());
+		meshes.back().triangles = triangles;
+		meshes.back().Build();
+		return meshes.size() - 1;
+	}
+
+	void AddInstance( int mesh, const glm::mat4& transform )
+	{
+		Instance instance;
+		instance.mesh = mesh;
+		instance.transform = transform;
+		instance.inverse = glm::inverse(transform);
+		instance.normalMatrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+
+		// Transform the corners of the object space box
+		const AABB& b = meshes[mesh].bounds;
+		for(int c = 0; c < 8; c++)
+		{
+			glm::vec3 corner((c & 1) ? b.max.x : b.min.x, (c & 2) ? b.max.y : b.min.y, (c & 4) ? b.max.z : b.min.z);
+			instance.bounds.Grow(glm::vec3(transform * glm::vec4(corner, 1.0f)));
+		}
+		instances.push_back(instance);
+	}
+
+	// Rebuilds the top level over the instance boxes. Call after adding or moving instances
+	void BuildTopLevel()
+	{
+		std::vector<AABB> boxes(instances.size());
+		for(size_t i = 0; i < instances.size(); i++)
+			boxes[i] = instances[i].bounds;
+		top.Build(boxes);
+	}
+
+	bool Empty() const
+	{
+		return instances.empty();
+	}
+
+	// Finds the closest hit with t < hit.t among all instances. Sets hit.instanceIndex and
+	// leaves hit.triangleIndex indexing the instance's mesh triangles. t is the same in world
+	// and object space because the direction is transformed without renormalising.
+	bool Intersect( const glm::vec3& start, const glm::vec3& dir, Hit& hit ) const
+	{
+		if(instances.empty())
+			return false;
+
+		RayBoxData ray(start, dir);
+		bool found = false;
+
+		int stack[64];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while(stackSize > 0)
+		{
+			const BVHNode& node = top.nodes[stack[--stackSize]];
+			if(IntersectAABB(ray, node.bounds, hit.t) == std::numeric_limits<float>::max())
+				continue;
+
+			if(node.count > 0)
+			{
+				for(int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+				{
+					int index = top.triIndices[i];
+					const Instance& instance = instances[index];
+					const Mesh& mesh = meshes[instance.mesh];
+					glm::vec3 objectStart(instance.inverse * glm::vec4(start, 1.0f));
+					glm::vec3 objectDir(instance.inverse * glm::vec4(dir, 0.0f));
+					if(mesh.bvh.Intersect(mesh.store, objectStart, objectDir, hit))
+					{
+						hit.instanceIndex = index;
+						found = true;
+					}
+				}
+			}
+			else
+			{
+				stack[stackSize++] = node.leftFirst + 1;
+				stack[stackSize++] = node.leftFirst;
+			}
+		}
+
+		return found;
+	}
+
+	// Returns true as soon as any instance blocks the ray with tMin < t < tMax. If blocker is given
+	// its triangleIndex and instanceIndex are set to the triangle that blocked it
+	bool Occluded( const glm::vec3& start, const glm::vec3& dir, float tMin, float tMax, Hit* blocker = 0 ) const
+	{
+		if(instances.empty())
+			return false;
+
+		RayBoxData ray(start, dir);
+
+		int stack[64];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while(stackSize > 0)
+		{
+			const BVHNode& node = top.nodes[stack[--stackSize]];
+			if(IntersectAABB(ray, node.bounds, tMax) == std::numeric_limits<float>::max())
+				continue;
+
+			if(node.count > 0)
+			{
+				for(int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+				{
+					int index = top.triIndices[i];
+					const Instance& instance = instances[index];
+					const Mesh& mesh = meshes[instance.mesh];
+					glm::vec3 objectStart(instance.inverse * glm::vec4(start, 1.0f));
+					glm::vec3 objectDir(instance.inverse * glm::vec4(dir, 0.0f));
+					if(mesh.bvh.Occluded(mesh.store, objectStart, objectDir, tMin, tMax, blocker ? &blocker->triangleIndex : 0))
+					{
+						if(blocker)
+							blocker->instanceIndex = index;
+						return true;
+					}
+				}
+			}
+			else
+			{
+				stack[stackSize++] = node.leftFirst + 1;
+				stack[stackSize++] = node.leftFirst;
+			}
+		}
+
+		return false;
+	}
+
+	// Shadow ray test against a single triangle of one instance
+	bool OccludedBy( int index, int triangle, const glm::vec3& start, const glm::vec3& dir, float tMin, float tMax ) const
+	{
+		const Instance& instance = instances[index];
+		glm::vec3 objectStart(instance.inverse * glm::vec4(start, 1.0f));
+		glm::vec3 objectDir(instance.inverse * glm::vec4(dir, 0.0f));
+		return TriangleStore::OccludedBy(meshes[instance.mesh].triangles[triangle], objectStart, objectDir, tMin, tMax);
+	}
+
+	size_t MeshMemoryUsage() const
+	{
+		size_t total = 0;
+		for(size_t i = 0; i < meshes.size(); i++)
+			total += meshes[i].MemoryUsage();
+		return total;
+	}
+
+	size_t InstanceMemoryUsage() const
+	{
+		return instances.size() * sizeof(Instance) + top.nodes.size() * sizeof(BVHNode) + top.triIndices.size() * sizeof(int);
+	}
+};
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef KD_TREE_H
+#define KD_TREE_H
+
+// SAH kd-tree over the scene triangles for static scenes, traversed without a per-ray stack.
+// Every leaf keeps the box of its cell and a rope for each of its six faces: the smallest
+// node whose cell covers that whole face. A ray walks the leaves in order by finding where it
+// leaves the current cell, following that face's rope and descending from there to the leaf
+// that contains the exit point. A triangle is referenced by every leaf its bounding box
+// overlaps, and the tree packs its own copy of the triangles leaf by leaf.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include "TestModel.h"
+#include "AABB.h"
+#include "TriangleStore.h"
+
+struct KdNode
+{
+	static const int LEAF = 3;
+
+	float split;
+	int axis;  // Split axis, or LEAF
+	int child; // Left child (the right one follows it), or the leaf index for leaves
+};
+
+struct KdLeaf
+{
+	AABB bounds;  // The leaf's cell, not the bounds of its triangles
+	int first;    // First entry in the triangle store
+	int count;
+	int rope[6];  // Node across the -x, +x, -y, +y, -z and +z faces, or -1 outside the tree
+};
+
+class KdTree
+{
+public:
+	std::vector<KdNode> nodes;
+	std::vector<KdLeaf> leaves;
+	AABB bounds;
+	int depth;
+	TriangleStore store; // Triangles packed leaf by leaf
+
+	KdTree() : depth(0){}
+
+	void Build( const std::vector<Triangle>& triangles )
+	{
+		Clear();
+		bounds = AABB();
+
+		boxes.assign(triangles.size(), AABB());
+		std::vector<int> all(triangles.size());
+		for(size_t i = 0; i < triangles.size(); i++)
+		{
+			boxes[i].Grow(triangles[i].v0);
+			boxes[i].Grow(triangles[i].v1);
+			boxes[i].Grow(triangles[i].v2);
+			bounds.Grow(boxes[i]);
+			all[i] = i;
+		}
+
+		std::vector<int> refs;
+		if(!triangles.empty())
+		{
+			int maxDepth = std::min(MAX_DEPTH, 8 + (int)(1.3f * log2f((float) triangles.size())));
+			nodes.push_back(KdNode());
+			Subdivide(0, all, bounds, 1, maxDepth, refs);
+
+			int ropes[6] = { -1, -1, -1, -1, -1, -1 };
+			BuildRopes(0, ropes);
+		}
+		store.Build(triangles, refs);
+
+		boxes.clear();
+		boxes.shrink_to_fit();
+	}
+
+	void Clear()
+	{
+		nodes.clear();
+		leaves.clear();
+		depth = 0;
+		store.Build(std::vector<Triangle>(), std::vector<int>());
+	}
+
+	bool Empty() const
+	{
+		return nodes.empty();
+	}
+
+	// Finds the closest hit with t < hit.t. hit.t should be initialised to the maximum distance.
+	bool Intersect( const glm::vec3& start, const glm::vec3& dir, Hit& hit ) const
+	{
+		if(nodes.empty())
+			return false;
+
+		RayBoxData ray(start, dir);
+		float tEntry = IntersectAABB(ray, bounds, hit.t);
+		if(tEntry == std::numeric_limits<float>::max())
+			return false;
+
+		bool found = false;
+		int node = 0;
+		int face = -1;
+		while(true)
+		{
+			const KdLeaf& leaf = leaves[Descend(node, face, start + dir * tEntry, ray)];
+			if(store.IntersectRange(leaf.first, leaf.count, start, dir, hit))
+				found = true;
+
+			// As in the grid, only a hit inside this cell ends the walk
+			float tExit = Exit(leaf, ray, face);
+			if(hit.t <= tExit || leaf.rope[face] < 0)
+				break;
+			node = leaf.rope[face];
+			tEntry = tExit;
+		}
+		return found;
+	}
+
+	// Returns true as soon as any triangle is hit with tMin < t < tMax
+	bool Occluded( const glm::vec3& start, const glm::vec3& dir, float tMin, float tMax, int* blocker = 0 ) const
+	{
+		if(nodes.empty())
+			return false;
+
+		RayBoxData ray(start, dir);
+		float tEntry = IntersectAABB(ray, bounds, tMax);
+		if(tEntry == std::numeric_limits<float>::max())
+			return false;
+
+		int node = 0;
+		int face = -1;
+		while(true)
+		{
+			const KdLeaf& leaf = leaves[Descend(node, face, start + dir * tEntry, ray)];
+			if(store.OccludedRange(leaf.first, leaf.count, start, dir, tMin, tMax, blocker))
+				return true;
+
+			float tExit = Exit(leaf, ray, face);
+			if(tExit >= tMax || leaf.rope[face] < 0)
+				return false;
+			node = leaf.rope[face];
+			tEntry = tExit;
+		}
+	}
+
+	int References() const
+	{
+		return store.count;
+	}
+
+	size_t MemoryUsage() const
+	{
+		return nodes.size() * sizeof(KdNode) + leaves.size() * sizeof(KdLeaf);
+	}
+
+private:
+	static const int SAH_BINS = 32;
+	static const int MAX_DEPTH = 40;
+	static const int MIN_LEAF_SIZE = 4;
+	static constexpr float TRAVERSAL_COST = 4.0f; // Relative to one triangle test. Leaves test 8 (AVX) triangles at once, so steps cost more
+	static constexpr float INTERSECTION_COST = 1.0f;
+	static constexpr float EMPTY_BONUS = 0.8f; // Discount for splits that cut off empty space
+
+	std::vector<AABB> boxes; // Triangle bounds, only kept while building
+
+	// Part of a triangle's box inside the cell on the given axis
+	void Clip( int tri, const AABB& cell, int axis, float& lo, float& hi ) const
+	{
+		lo = std::max(boxes[tri].min[axis], cell.min[axis]);
+		hi = std::min(boxes[tri].max[axis], cell.max[axis]);
+	}
+
+	int Bin( float x, float origin, float scale ) const
+	{
+		return std::min(SAH_BINS - 1, std::max(0, (int)((x - origin) * scale)));
+	}
+
+	void MakeLeaf( int nodeIdx, const std::vector<int>& tris, const AABB& cell, std::vector<int>& refs )
+	{
+		KdLeaf leaf;
+		leaf.bounds = cell;
+		leaf.first = refs.size();
+		leaf.count = tris.size();
+		refs.insert(refs.end(), tris.begin(), tris.end());
+
+		nodes[nodeIdx].axis = KdNode::LEAF;
+		nodes[nodeIdx].split = 0.0f;
+		nodes[nodeIdx].child = leaves.size();
+		leaves.push_back(leaf);
+	}
+
+	void Subdivide( int nodeIdx, std::vector<int>& tris, const AABB& cell, int nodeDepth, int maxDepth, std::vector<int>& refs )
+	{
+		depth = std::max(depth, nodeDepth);
+		int count = tris.size();
+		if(count <= MIN_LEAF_SIZE || nodeDepth >= maxDepth)
+		{
+			MakeLeaf(nodeIdx, tris, cell, refs);
+			return;
+		}
+
+		// Bin where the clipped triangle boxes start and end along each axis, then sweep the
+		// bin boundaries counting the triangles on either side of each candidate plane
+		float area = cell.SurfaceArea();
+		float bestCost = INTERSECTION_COST * count;
+		int bestAxis = -1;
+		float bestSplit = 0.0f;
+
+		for(int axis = 0; axis < 3; axis++)
+		{
+			float extent = cell.max[axis] - cell.min[axis];
+			if(extent <= 0.0f)
+				continue;
+			float scale = SAH_BINS / extent;
+
+			int starts[SAH_BINS] = {0}, ends[SAH_BINS] = {0};
+			for(int i = 0; i < count; i++)
+			{
+				float lo, hi;
+				Clip(tris[i], cell, axis, lo, hi);
+				starts[Bin(lo, cell.min[axis], scale)]++;
+				ends[Bin(hi, cell.min[axis], scale)]++;
+			}
+
+			int leftCount = 0, rightCount = count;
+			for(int b = 1; b < SAH_BINS; b++)
+			{
+				leftCount += starts[b - 1];
+				rightCount -= ends[b - 1];
+				float split = cell.min[axis] + b * extent / SAH_BINS;
+
+				AABB left = cell, right = cell;
+				left.max[axis] = split;
+				right.min[axis] = split;
+				float cost = TRAVERSAL_COST + INTERSECTION_COST *
+					(left.SurfaceArea() * leftCount + right.SurfaceArea() * rightCount) / area;
+				if(leftCount == 0 || rightCount == 0)
+					cost *= EMPTY_BONUS;
+
+				if(cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = split;
+				}
+			}
+		}
+
+		if(bestAxis == -1)
+		{
+			MakeLeaf(nodeIdx, tris, cell, refs);
+			return;
+		}
+
+		// Triangles lying in the split plane go to both sides
+		std::vector<int> leftTris, rightTris;
+		for(int i = 0; i < count; i++)
+		{
+			float lo, hi;
+			Clip(tris[i], cell, bestAxis, lo, hi);
+			bool planar = lo == hi && lo == bestSplit;
+			if(lo < bestSplit || planar)
+				leftTris.push_back(tris[i]);
+			if(hi > bestSplit || planar)
+				rightTris.push_back(tris[i]);
+		}
+
+		// Splitting didn't separate anything, so further splits would only duplicate references
+		if((int) leftTris.size() == count && (int) rightTris.size() == count)
+		{
+			MakeLeaf(nodeIdx, tris, cell, refs);
+			return;
+		}
+		std::vector<int>().swap(tris);
+
+		AABB leftCell = cell, rightCell = cell;
+		leftCell.max[bestAxis] = bestSplit;
+		rightCell.min[bestAxis] = bestSplit;
+
+		int leftIdx = nodes.size();
+		nodes.push_back(KdNode());
+		nodes.push_back(KdNode());
+		nodes[nodeIdx].axis = bestAxis;
+		nodes[nodeIdx].split = bestSplit;
+		nodes[nodeIdx].child = leftIdx;
+
+		Subdivide(leftIdx, leftTris, leftCell, nodeDepth + 1, maxDepth, refs);
+		Subdivide(leftIdx + 1, rightTris, rightCell, nodeDepth + 1, maxDepth, refs);
+	}
+
+	// Hands each child the ropes of its parent, with the face on the split plane pointing at its sibling
+	void BuildRopes( int nodeIdx, const int ropes[6] )
+	{
+		const KdNode& node = nodes[nodeIdx];
+		if(node.axis == KdNode::LEAF)
+		{
+			std::copy(ropes, ropes + 6, leaves[node.child].rope);
+			return;
+		}
+
+		int left[6], right[6];
+		std::copy(ropes, ropes + 6, left);
+		std::copy(ropes, ropes + 6, right);
+		left[node.axis * 2 + 1] = node.child + 1;
+		right[node.axis * 2] = node.child;
+		BuildRopes(node.child, left);
+		BuildRopes(node.child + 1, right);
+	}
+
+	// Walks down from node to the leaf containing p. After following a rope the ray has just
+	// crossed the face it came through, so splits on that axis take the side next to the face
+	// rather than trusting p, which keeps rounding from sending it back into the leaf it left
+	int Descend( int node, int face, const glm::vec3& p, const RayBoxData& ray ) const
+	{
+		int faceAxis = face >= 0 ? face / 2 : -1;
+		while(nodes[node].axis != KdNode::LEAF)
+		{
+			const KdNode& n = nodes[node];
+			bool positive = ray.invDir[n.axis] > 0.0f;
+			bool left;
+			if(n.axis == faceAxis)
+				left = positive;
+			else
+				left = p[n.axis] < n.split || (p[n.axis] == n.split && !positive);
+			node = n.child + (left ? 0 : 1);
+		}
+		return nodes[node].child;
+	}
+
+	// Distance at which the ray leaves the leaf's cell, and the face it leaves through
+	static float Exit( const KdLeaf& leaf, const RayBoxData& ray, int& face )
+	{
+		float tExit = std::numeric_limits<float>::max();
+		for(int axis = 0; axis < 3; axis++)
+		{
+			bool positive = ray.invDir[axis] > 0.0f;
+			float plane = positive ? leaf.bounds.max[axis] : leaf.bounds.min[axis];
+			float t = (plane - ray.origin[axis]) * ray.invDir[axis];
+			if(t < tExit)
+			{
+				tExit = t;
+				face = axis * 2 + (positive ? 1 : 0);
+			}
+		}
+		return tExit;
+	}
+};
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+// Bounding volume hierarchy over the lights, used to pick a light for a shadow ray in proportion
+// to how much it is likely to bring to a point instead of trying every light. Each node keeps
+// the bounds and total power of the lights under it. A pick walks down from the root, choosing
+// between the two children by their importance to the point: power over squared distance, times
+// a bound on the cosine between the surface normal and any direction into the node's bounding
+// sphere, which is zero when the whole sphere is behind the surface. The probability of the
+// light it ends at is the product of the choices made on the way, so the caller can weight its
+// contribution.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "AABB.h"
+
+// Interior nodes store the index of their left child (the right child is stored next to it)
+// and have a count of 0. Leaves hold one light, stored in lightIndices at leftFirst
+struct LightNode
+{
+	AABB bounds;
+	glm::vec3 centre; // Of the bounds, with the radius of the sphere around them
+	float radius;
+	float power;
+	int leftFirst;
+	int count;
+};
+
+class LightTree
+{
+public:
+	std::vector<LightNode> nodes;
+	std::vector<int> lightIndices;
+	bool valid; // Cleared whenever the lights change
+
+	LightTree() : valid(false){}
+
+	// Builds over the lights given by the bounds of everywhere they can be sampled from and their power
+	void Build( const std::vector<AABB>& boxes, const std::vector<float>& power )
+	{
+		int n = boxes.size();
+		lightIndices.resize(n);
+		for(int i = 0; i < n; i++)
+			lightIndices[i] = i;
+
+		nodes.clear();
+		if(n > 0)
+		{
+			nodes.reserve(2*n - 1);
+			nodes.push_back(LightNode());
+			Subdivide(boxes, power, 0, 0, n);
+		}
+		valid = true;
+	}
+
+	void Invalidate()
+	{
+		valid = false;
+	}
+
+	bool Empty() const
+	{
+		return nodes.empty();
+	}
+
+	// Picks a light for the point with normal n, using u in [0,1) to make the choices. Returns the
+	// probability it was picked with, or 0 if every light is behind the surface
+	float Sample( const glm::vec3& point, const glm::vec3& n, float u, int& light ) const
+	{
+		if(nodes.empty())
+			return 0.0f;
+
+		// Every child picked below has a nonzero importance, so only a lone light needs checking
+		if(nodes[0].count > 0 && Importance(nodes[0], point, n) <= 0.0f)
+			return 0.0f;
+
+		float pdf = 1.0f;
+		int node = 0;
+		while(nodes[node].count == 0)
+		{
+			int left = nodes[node].leftFirst;
+			float wl = Importance(nodes[left], point, n);
+			float wr = Importance(nodes[left + 1], point, n);
+			if(wl + wr <= 0.0f)
+				return 0.0f;
+
+			// Rescale u to [0,1) within the chosen side so it can make the next choice too
+			float pl = wl / (wl + wr);
+			if(u < pl)
+			{
+				u = u / pl;
+				pdf *= pl;
+				node = left;
+			}
+			else
+			{
+				u = (u - pl) / (1.0f - pl);
+				pdf *= 1.0f - pl;
+				node = left + 1;
+			}
+			u = std::min(u, 0.99999994f);
+		}
+
+		light = lightIndices[nodes[node].leftFirst];
+		return pdf;
+	}
+
+	size_t MemoryUsage() const
+	{
+		return nodes.size() * sizeof(LightNode) + lightIndices.size() * sizeof(int);
+	}
+
+private:
+	// Estimate of the light reaching the point from the lights under a node. A point inside the
+	// bounding sphere takes the distance as its radius, so it doesn't favour a nearby cluster
+	// without bound. Otherwise cos(angle to centre) + sin(sphere's half angle) bounds the cosine
+	// to every point in the sphere
+	static float Importance( const LightNode& node, const glm::vec3& point, const glm::vec3& n )
+	{
+		glm::vec3 toCentre = node.centre - point;
+		float distanceSq = glm::dot(toCentre, toCentre);
+		float radiusSq = node.radius * node.radius;
+		if(distanceSq <= radiusSq)
+			return node.power / std::max(radiusSq, 1e-8f);
+
+		float distance = sqrtf(distanceSq);
+		float facing = std::min(1.0f, (glm::dot(toCentre, n) + node.radius) / distance);
+		if(facing <= 0.0f)
+			return 0.0f;
+		return node.power * facing / distanceSq;
+	}
+
+	// Splits lights [first, first + count) at the median of the longest axis of their centres
+	void Subdivide( const std::vector<AABB>& boxes, const std::vector<float>& power, int index, int first, int count )
+	{
+		AABB bounds, centres;
+		float total = 0.0f;
+		for(int i = first; i < first + count; i++)
+		{
+			const AABB& b = boxes[lightIndices[i]];
+			bounds.Grow(b);
+			centres.Grow((b.min + b.max) * 0.5f);
+			total += power[lightIndices[i]];
+		}
+		nodes[index].bounds = bounds;
+		nodes[index].centre = (bounds.min + bounds.max) * 0.5f;
+		nodes[index].radius = 0.5f * glm::length(bounds.max - bounds.min);
+		nodes[index].power = total;
+
+		if(count == 1)
+		{
+			nodes[index].leftFirst = first;
+			nodes[index].count = 1;
+			return;
+		}
+
+		glm::vec3 extent = centres.max - centres.min;
+		int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+		int half = count / 2;
+		std::nth_element(lightIndices.begin() + first, lightIndices.begin() + first + half, lightIndices.begin() + first + count,
+						 [&]( int a, int b ){ return boxes[a].min[axis] + boxes[a].max[axis] < boxes[b].min[axis] + boxes[b].max[axis]; });
+
+		int left = nodes.size();
+		nodes.push_back(LightNode());
+		nodes.push_back(LightNode());
+		nodes[index].leftFirst = left;
+		nodes[index].count = 0;
+		Subdivide(boxes, power, left, first, half);
+		Subdivide(boxes, power, left + 1, first + half, count - half);
+	}
+};
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef LIGHTMAP_H
+#define LIGHTMAP_H
+
+// Direct light baked over the scene triangles, so it can be looked up instead of traced while
+// only the camera moves. Each triangle gets a lattice of texels in its barycentric (u,v) space:
+// res+1 along each edge and (res+1)(res+2)/2 in all, with res chosen from the longest edge so
+// texels are about the same size on every triangle. A lookup interpolates between the three
+// texels around the point, so shadow edges are smooth at the texel spacing. The lightmap only
+// lays out and looks up the texels; whoever bakes it fills them in.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "TestModel.h"
+
+class Lightmap
+{
+public:
+	std::vector<int> first; // First texel of each triangle
+	std::vector<int> res;   // Lattice subdivisions along the edges of each triangle
+	std::vector<glm::vec3> texels;
+	bool valid;             // Cleared whenever the lights or the geometry change
+
+	Lightmap() : valid(false){}
+
+	// Lays out the texels for the triangles, leaving them to be baked
+	void Allocate( const std::vector<Triangle>& triangles )
+	{
+		valid = false;
+		first.resize(triangles.size());
+		res.resize(triangles.size());
+		int count = 0;
+		for(size_t t = 0; t < triangles.size(); t++)
+		{
+			const Triangle& tri = triangles[t];
+			float edge = std::max(std::max(glm::length(tri.v1 - tri.v0), glm::length(tri.v2 - tri.v0)), glm::length(tri.v2 - tri.v1));
+			res[t] = std::min(MAX_RES, std::max(1, (int) ceilf(edge * TEXELS_PER_UNIT)));
+			first[t] = count;
+			count += (res[t] + 1) * (res[t] + 2) / 2;
+		}
+		texels.assign(count, glm::vec3(0.0f));
+	}
+
+	void Invalidate()
+	{
+		valid = false;
+	}
+
+	// Index of texel (i,j) within its triangle, at (u,v) = (i,j) / res. Texels are stored row by
+	// row of j, so looping over j and then i visits them in order
+	static int Index( int res, int i, int j )
+	{
+		return j * (res + 1) - j * (j - 1) / 2 + i;
+	}
+
+	// Where texel (i,j) of the triangle is baked. Pulled very slightly towards the middle of the
+	// triangle, so texels on an edge shared with another surface belong to this one
+	static glm::vec3 TexelPosition( const Triangle& tri, int res, int i, int j )
+	{
+		float u = (float) i / res;
+		float v = (float) j / res;
+		u += (1.0f / 3.0f - u) * INSET;
+		v += (1.0f / 3.0f - v) * INSET;
+		return tri.v0 + u * (tri.v1 - tri.v0) + v * (tri.v2 - tri.v0);
+	}
+
+	// Baked light at barycentric (u,v) on the triangle
+	glm::vec3 Lookup( int triangle, float u, float v ) const
+	{
+		int n = res[triangle];
+		const glm::vec3* t = &texels[first[triangle]];
+
+		// Find the lattice cell around the point. Each cell is split along its diagonal into a
+		// lower triangle, (i,j) (i+1,j) (i,j+1), and an upper one that the edges of the
+		// triangle leave out of the last cell on each row
+		float x = std::max(0.0f, u) * n;
+		float y = std::max(0.0f, v) * n;
+		int j = std::min((int) y, n - 1);
+		int i = std::min((int) x, n - 1 - j);
+		float fu = std::min(1.0f, std::max(0.0f, x - i));
+		float fv = std::min(1.0f, std::max(0.0f, y - j));
+
+		if(fu + fv <= 1.0f)
+			return (1.0f - fu - fv) * t[Index(n, i, j)] + fu * t[Index(n, i + 1, j)] + fv * t[Index(n, i, j + 1)];
+		if(i + j == n - 1)
+		{
+			// Rounding put the point just past the triangle's far edge
+			float sum = fu + fv;
+			return (fu / sum) * t[Index(n, i + 1, j)] + (fv / sum) * t[Index(n, i, j + 1)];
+		}
+		return (fu + fv - 1.0f) * t[Index(n, i + 1, j + 1)] + (1.0f - fv) * t[Index(n, i + 1, j)] + (1.0f - fu) * t[Index(n, i, j + 1)];
+	}
+
+	size_t MemoryUsage() const
+	{
+		return texels.size() * sizeof(glm::vec3) + (first.size() + res.size()) * sizeof(int);
+	}
+
+private:
+	static const int MAX_RES = 256;
+	static constexpr float TEXELS_PER_UNIT = 100.0f; // The Cornell box is 2 units across
+	static constexpr float INSET = 1e-3f;
+};
+
+#endif
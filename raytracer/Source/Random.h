@@ -0,0 +1,52 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+// Counter-based random numbers. Every value is a hash of a key and its index in the sequence, so
+// a generator is just those two integers and shares nothing with other threads. The same key
+// always gives the same sequence, whichever thread draws it and whatever was drawn before, and
+// any value can be had directly by its index. Keys are built from up to three integers, such as
+// a pixel, a sample index and a frame. The hash is PCG's output permutation applied to one step
+// of its LCG, which is cheap and mixes well enough to use on consecutive integers.
+
+#include <stdint.h>
+
+class Random
+{
+public:
+	explicit Random( uint32_t a, uint32_t b = 0, uint32_t c = 0 ) : key(Hash(a ^ Hash(b ^ Hash(c)))), counter(0){}
+
+	uint32_t NextBits()
+	{
+		return BitsAt(counter++);
+	}
+
+	// In [0,1), with 24 bits so every value is exact in a float
+	float Next()
+	{
+		return At(counter++);
+	}
+
+	// Value number index of the sequence, without moving on
+	uint32_t BitsAt( uint32_t index ) const
+	{
+		return Hash(key + Hash(index));
+	}
+
+	float At( uint32_t index ) const
+	{
+		return (BitsAt(index) >> 8) * (1.0f / 16777216.0f);
+	}
+
+	static uint32_t Hash( uint32_t v )
+	{
+		uint32_t state = v * 747796405u + 2891336453u;
+		uint32_t word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+		return (word >> 22) ^ word;
+	}
+
+private:
+	uint32_t key;
+	uint32_t counter;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+// A block of primary rays traced together through the acceleration structure. Every ray
+// starts at the camera, so the four corner rays of the block bound all of them and give
+// the side planes of the packet frustum. A node that lies outside the frustum can be
+// culled for the whole packet with a single test.
+
+#include <glm/glm.hpp>
+#include <limits>
+#include "AABB.h"
+#include "TriangleStore.h"
+
+struct RayPacket
+{
+	static const int BLOCK_SIZE = 8;
+	static const int MAX_RAYS = BLOCK_SIZE * BLOCK_SIZE;
+
+	int count;
+	glm::vec3 origin;
+	glm::vec3 dir[MAX_RAYS];
+	RayBoxData rays[MAX_RAYS];
+	Hit hit[MAX_RAYS];
+	glm::vec3 planes[4]; // Inward facing normals of the frustum side planes, which all pass through origin
+
+	RayPacket() : count(0){}
+
+	void Begin( const glm::vec3& start )
+	{
+		origin = start;
+		count = 0;
+	}
+
+	void AddRay( const glm::vec3& d, float tMax )
+	{
+		dir[count] = d;
+		rays[count] = RayBoxData(origin, d);
+		hit[count].t = tMax;
+		hit[count].triangleIndex = -1;
+		hit[count].instanceIndex = -1;
+		count++;
+	}
+
+	// Corner directions must be given in order around the block
+	void SetFrustum( const glm::vec3 corners[4] )
+	{
+		glm::vec3 centre = corners[0] + corners[1] + corners[2] + corners[3];
+		for(int i = 0; i < 4; i++)
+		{
+			planes[i] = glm::cross(corners[i], corners[(i+1) % 4]);
+			if(glm::dot(planes[i], centre) < 0.0f)
+				planes[i] = -planes[i];
+		}
+	}
+
+	// False if the box is entirely outside one of the frustum planes
+	bool FrustumOverlaps( const AABB& box ) const
+	{
+		for(int i = 0; i < 4; i++)
+		{
+			// Corner of the box furthest along the plane normal
+			glm::vec3 p(planes[i].x > 0.0f ? box.max.x : box.min.x,
+						planes[i].y > 0.0f ? box.max.y : box.min.y,
+						planes[i].z > 0.0f ? box.max.z : box.min.z);
+			if(glm::dot(planes[i], p - origin) < 0.0f)
+				return false;
+		}
+		return true;
+	}
+
+	// Returns the first ray at or after first that hits the box closer than its current hit, or count if none do
+	int FirstHit( const AABB& box, int first ) const
+	{
+		if(IntersectAABB(rays[first], box, hit[first].t) != std::numeric_limits<float>::max())
+			return first;
+		if(!FrustumOverlaps(box))
+			return count;
+		for(int r = first + 1; r < count; r++)
+		{
+			if(IntersectAABB(rays[r], box, hit[r].t) != std::numeric_limits<float>::max())
+				return r;
+		}
+		return count;
+	}
+};
+
+#endif
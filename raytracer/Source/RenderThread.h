@@ -0,0 +1,111 @@
+#ifndef RENDER_THREAD_H
+#define RENDER_THREAD_H
+
+// A thread that runs one render job at a time, so the thread that owns the window can keep
+// handling events however long a frame takes. Jobs are given a cancellation flag to check
+// between tiles of work. Once it is set they skip whatever is left, so a frame that has gone
+// stale stops within a tile. Starting a job and changing anything it reads are left to the
+// caller, and only while the thread is idle.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+
+class RenderThread
+{
+public:
+	RenderThread() : busy(false), quit(false), cancelled(false){}
+
+	~RenderThread()
+	{
+		Stop();
+	}
+
+	// Runs the job on the render thread, which is started the first time. Only call while idle
+	void Start( const std::function<void()>& next )
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if(!worker.joinable())
+			worker = std::thread(&RenderThread::Run, this);
+		job = next;
+		cancelled = false;
+		busy = true;
+		wake.notify_one();
+	}
+
+	// Asks the job in flight to stop at the next tile
+	void Cancel()
+	{
+		cancelled = true;
+	}
+
+	// Whether the current or last job was cancelled. Jobs check it before every tile
+	bool Cancelled() const
+	{
+		return cancelled.load(std::memory_order_relaxed);
+	}
+
+	bool Busy()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		return busy;
+	}
+
+	// Waits up to the given time for the job in flight to finish. Returns whether it has
+	bool WaitFor( int milliseconds )
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		return done.wait_for(lock, std::chrono::milliseconds(milliseconds), [this]{ return !busy; });
+	}
+
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this]{ return !busy; });
+	}
+
+	// Cancels the job in flight and ends the thread
+	void Stop()
+	{
+		if(!worker.joinable())
+			return;
+		Cancel();
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			quit = true;
+			wake.notify_one();
+		}
+		worker.join();
+	}
+
+private:
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	std::function<void()> job;
+	bool busy, quit;
+	std::atomic<bool> cancelled;
+
+	void Run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true)
+		{
+			wake.wait(lock, [this]{ return busy || quit; });
+			if(quit)
+				return;
+
+			lock.unlock();
+			job();
+			lock.lock();
+
+			busy = false;
+			done.notify_all();
+		}
+	}
+};
+
+#endif
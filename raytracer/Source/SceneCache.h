@@ -0,0 +1,333 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+// Binary cache of a parsed STL mesh and everything built over it, so a later run can skip
+// parsing and building. The cache sits next to the STL and starts with a header that holds
+// a format version, the sizes of the stored structs and a hash of the STL's bytes. A cache
+// from another version or for a changed file is ignored and written again. Every array is
+// stored at a 64 byte aligned offset, so it can be copied straight out of the mapped file.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "TestModel.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "CompressedBVH.h"
+#include "KdTree.h"
+#include "TriangleStore.h"
+
+struct SceneCacheHeader
+{
+	static const uint32_t VERSION = 2; // Bump whenever a stored struct or the build changes
+
+	char magic[8];
+	uint32_t version;
+	uint32_t simdWidth;
+	uint32_t structSizes[6]; // Triangle, BVHNode, WideBVHNode, CompressedBVHNode, KdNode, KdLeaf
+	uint64_t meshHash;
+	uint64_t meshSize;
+};
+
+// Read only view of a whole file
+class MappedFile
+{
+public:
+	const char* data;
+	size_t size;
+
+	MappedFile() : data(0), size(0){}
+	~MappedFile() { Close(); }
+
+	bool Open( const char* path )
+	{
+		Close();
+		int fd = open(path, O_RDONLY);
+		if(fd < 0)
+			return false;
+
+		struct stat info;
+		if(fstat(fd, &info) == 0 && info.st_size > 0)
+		{
+			void* p = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(p != MAP_FAILED)
+			{
+				data = (const char*) p;
+				size = info.st_size;
+			}
+		}
+		close(fd);
+		return data != 0;
+	}
+
+	void Close()
+	{
+		if(data)
+			munmap((void*) data, size);
+		data = 0;
+		size = 0;
+	}
+};
+
+// 64 bit hash of a block of bytes, mixed 8 bytes at a time so big files hash at memory speed
+inline uint64_t HashBytes( const char* data, size_t size )
+{
+	uint64_t h = 0xcbf29ce484222325ull ^ size;
+	size_t words = size / 8;
+	for(size_t i = 0; i < words; i++)
+	{
+		uint64_t w;
+		memcpy(&w, data + i*8, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 29;
+	}
+	for(size_t i = words * 8; i < size; i++)
+		h = (h ^ (unsigned char) data[i]) * 0x100000001b3ull;
+	return h;
+}
+
+class SceneCache
+{
+public:
+	// Fills the scene from the cache for the STL at meshPath. Returns false if there is no
+	// usable cache for the file as it is now
+	static bool Load( const char* meshPath, std::vector<Triangle>& triangles, BVH& bvh, WideBVH& wideBVH,
+					  CompressedBVH& compressedBVH, KdTree& kdTree, TriangleStore& store )
+	{
+		MappedFile mesh, cache;
+		if(!mesh.Open(meshPath) || !cache.Open(CachePath(meshPath).c_str()))
+			return false;
+
+		SceneCacheHeader expected = MakeHeader(mesh);
+		if(cache.size < sizeof(SceneCacheHeader) || memcmp(cache.data, &expected, sizeof(SceneCacheHeader)) != 0)
+			return false;
+
+		Reader in(cache.data, cache.size);
+		in.Skip(sizeof(SceneCacheHeader));
+
+		in.ReadArray(triangles);
+
+		in.ReadArray(bvh.nodes);
+		in.ReadArray(bvh.triIndices);
+		in.Read(bvh.depth);
+		in.Read(bvh.buildCost);
+
+		in.ReadArray(wideBVH.nodes);
+		in.ReadArray(wideBVH.sources);
+		in.Read(wideBVH.rootBounds);
+		in.Read(wideBVH.depth);
+
+		in.ReadArray(compressedBVH.nodes);
+		in.Read(compressedBVH.rootBounds);
+
+		in.ReadArray(kdTree.nodes);
+		in.ReadArray(kdTree.leaves);
+		in.Read(kdTree.bounds);
+		in.Read(kdTree.depth);
+		ReadStore(in, kdTree.store);
+
+		ReadStore(in, store);
+
+		if(!in.ok)
+			return false;
+
+		bvh.BuildLevels();
+		return true;
+	}
+
+	// Writes the scene built from the STL at meshPath to its cache
+	static bool Save( const char* meshPath, const std::vector<Triangle>& triangles, const BVH& bvh, const WideBVH& wideBVH,
+					  const CompressedBVH& compressedBVH, const KdTree& kdTree, const TriangleStore& store )
+	{
+		MappedFile mesh;
+		if(!mesh.Open(meshPath))
+			return false;
+
+		// Write to a temporary file and rename it, so a run that stops half way never leaves a broken cache
+		std::string path = CachePath(meshPath);
+		std::string temporary = path + ".tmp";
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if(!file)
+			return false;
+
+		Writer out(file);
+		SceneCacheHeader header = MakeHeader(mesh);
+		out.Write(header);
+
+		out.WriteArray(triangles);
+
+		out.WriteArray(bvh.nodes);
+		out.WriteArray(bvh.triIndices);
+		out.Write(bvh.depth);
+		out.Write(bvh.buildCost);
+
+		out.WriteArray(wideBVH.nodes);
+		out.WriteArray(wideBVH.sources);
+		out.Write(wideBVH.rootBounds);
+		out.Write(wideBVH.depth);
+
+		out.WriteArray(compressedBVH.nodes);
+		out.Write(compressedBVH.rootBounds);
+
+		out.WriteArray(kdTree.nodes);
+		out.WriteArray(kdTree.leaves);
+		out.Write(kdTree.bounds);
+		out.Write(kdTree.depth);
+		WriteStore(out, kdTree.store);
+
+		WriteStore(out, store);
+
+		bool ok = out.ok;
+		if(fclose(file) != 0)
+			ok = false;
+		if(!ok || rename(temporary.c_str(), path.c_str()) != 0)
+		{
+			remove(temporary.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	static std::string CachePath( const char* meshPath )
+	{
+		return std::string(meshPath) + ".cache";
+	}
+
+private:
+	static const size_t ALIGNMENT = 64;
+
+	static SceneCacheHeader MakeHeader( const MappedFile& mesh )
+	{
+		SceneCacheHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "RTCACHE", 8);
+		header.version = SceneCacheHeader::VERSION;
+		header.simdWidth = SIMD_WIDTH;
+		header.structSizes[0] = sizeof(Triangle);
+		header.structSizes[1] = sizeof(BVHNode);
+		header.structSizes[2] = sizeof(WideBVHNode);
+		header.structSizes[3] = sizeof(CompressedBVHNode);
+		header.structSizes[4] = sizeof(KdNode);
+		header.structSizes[5] = sizeof(KdLeaf);
+		header.meshHash = HashBytes(mesh.data, mesh.size);
+		header.meshSize = mesh.size;
+		return header;
+	}
+
+	static size_t Padding( size_t offset )
+	{
+		return (ALIGNMENT - offset % ALIGNMENT) % ALIGNMENT;
+	}
+
+	// Arrays are stored as a 64 bit element count followed by the elements, which start on an aligned offset
+	class Writer
+	{
+	public:
+		bool ok;
+
+		Writer( FILE* file ) : ok(true), file(file), offset(0){}
+
+		template<class T> void Write( const T& value )
+		{
+			WriteBytes(&value, sizeof(T));
+		}
+
+		template<class T> void WriteArray( const std::vector<T>& values )
+		{
+			uint64_t count = values.size();
+			Write(count);
+			static const char zeros[ALIGNMENT] = {0};
+			WriteBytes(zeros, Padding(offset));
+			if(count > 0)
+				WriteBytes(&values[0], count * sizeof(T));
+		}
+
+	private:
+		FILE* file;
+		size_t offset;
+
+		void WriteBytes( const void* data, size_t size )
+		{
+			if(size > 0 && fwrite(data, 1, size, file) != size)
+				ok = false;
+			offset += size;
+		}
+	};
+
+	class Reader
+	{
+	public:
+		bool ok;
+
+		Reader( const char* data, size_t size ) : ok(true), data(data), size(size), offset(0){}
+
+		void Skip( size_t bytes )
+		{
+			if(offset + bytes > size)
+				ok = false;
+			else
+				offset += bytes;
+		}
+
+		template<class T> void Read( T& value )
+		{
+			if(offset + sizeof(T) > size)
+			{
+				ok = false;
+				return;
+			}
+			memcpy(&value, data + offset, sizeof(T));
+			offset += sizeof(T);
+		}
+
+		template<class T> void ReadArray( std::vector<T>& values )
+		{
+			uint64_t count = 0;
+			Read(count);
+			Skip(Padding(offset));
+			if(!ok || count > (size - offset) / sizeof(T))
+			{
+				ok = false;
+				return;
+			}
+			// The mapping is page aligned and the array offset is 64 byte aligned, so the elements can be read in place
+			const T* first = (const T*)(data + offset);
+			values.assign(first, first + count);
+			offset += count * sizeof(T);
+		}
+
+	private:
+		const char* data;
+		size_t size;
+		size_t offset;
+	};
+
+	static void WriteStore( Writer& out, const TriangleStore& store )
+	{
+		const std::vector<float>* arrays[] = { &store.v0x, &store.v0y, &store.v0z, &store.e1x, &store.e1y, &store.e1z,
+											   &store.e2x, &store.e2y, &store.e2z, &store.nx, &store.ny, &store.nz };
+		out.Write(store.count);
+		for(int a = 0; a < 12; a++)
+			out.WriteArray(*arrays[a]);
+		out.WriteArray(store.triangleIndex);
+	}
+
+	static void ReadStore( Reader& in, TriangleStore& store )
+	{
+		std::vector<float>* arrays[] = { &store.v0x, &store.v0y, &store.v0z, &store.e1x, &store.e1y, &store.e1z,
+										 &store.e2x, &store.e2y, &store.e2z, &store.nx, &store.ny, &store.nz };
+		in.Read(store.count);
+		for(int a = 0; a < 12; a++)
+			in.ReadArray(*arrays[a]);
+		in.ReadArray(store.triangleIndex);
+	}
+};
+
+#endif
@@ -32,16 +32,25 @@ public:
 };
 
 // Defines light parameters
+// Square area light lying level with the floor, centred on position. Hard shadows treat it as
+// a point light at its centre
 class Light
 {
 public:
 	glm::vec3 position;
 	glm::vec3 color;
 	float intensity;
+	float size; // Length of a side
 
-	Light(glm::vec3 position, glm::vec3 color, float intensity)
-	 : position(position), color(color), intensity(intensity){}
+	Light(glm::vec3 position, glm::vec3 color, float intensity, float size = 0.08f)
+	 : position(position), color(color), intensity(intensity), size(size){}
 	 Light(){}
+
+	// Point on the light at (u,v) in [0,1)^2
+	glm::vec3 SamplePosition( glm::vec2 uv ) const
+	{
+		return position + glm::vec3((uv.x - 0.5f) * size, 0.0f, (uv.y - 0.5f) * size);
+	}
 };
 
 // Loads the Cornell Box. It is scaled to fill the volume:
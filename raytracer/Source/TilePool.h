@@ -0,0 +1,314 @@
+#ifndef TILE_POOL_H
+#define TILE_POOL_H
+
+// Persistent pool of threads that share out the tiles of an image. Tiles are square and ordered
+// along a Morton curve, so tiles next to each other in the order are close on screen. Each
+// thread's queue starts as one contiguous run of that order, so every thread begins on its own
+// compact patch of the image. A thread takes tiles from the front of its own queue. Once that
+// is empty it steals the back half of the fullest queue, the tiles furthest from where their
+// owner is working. The threads are created once and sleep between jobs instead of being forked
+// for every loop, and each one records how long it spent in tiles so the balance can be checked.
+// Loops over anything other than pixels run on the same threads, cut into runs of indices that
+// are queued and stolen like tiles, so the frame never has a second set of threads competing.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+// Pixels [x0, x1) x [y0, y1)
+struct Tile
+{
+	int x0, y0, x1, y1;
+};
+
+// Work done by one thread since the stats were last reset. Aligned like the queues, as each
+// thread writes its own entry after every tile
+struct alignas(64) TileThreadStats
+{
+	double busy; // Seconds spent in tiles
+	int tiles;
+	int steals;
+};
+
+class TilePool
+{
+public:
+	TilePool() : threadCount(1), generation(0), active(0), quit(false), wall(0.0)
+	{
+		queues = std::vector<Queue>(1);
+		stats.resize(1);
+		ResetStats();
+	}
+
+	~TilePool()
+	{
+		Resize(1);
+	}
+
+	// Sets the number of threads, counting the one that calls Run. Threads are only created or
+	// ended when the number changes
+	void Resize( int threads )
+	{
+		threads = std::max(threads, 1);
+		if(threads == threadCount)
+			return;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			quit = true;
+			wake.notify_all();
+		}
+		for(size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+		workers.clear();
+
+		quit = false;
+		threadCount = threads;
+		queues = std::vector<Queue>(threads);
+		stats.resize(threads);
+		ResetStats();
+		for(int i = 1; i < threads; i++)
+			workers.push_back(std::thread(&TilePool::Work, this, i, generation));
+	}
+
+	int Threads() const
+	{
+		return threadCount;
+	}
+
+	// Calls tile(t) for every tile of a width x height image on all threads, returning once every
+	// tile is done. Tiles are tileSize pixels square, cut short at the right and bottom edges
+	void Run( int width, int height, int tileSize, const std::function<void(const Tile&)>& tile )
+	{
+		// Morton order of the tile grid, with the codes past its edges skipped
+		int tilesX = (width + tileSize - 1) / tileSize;
+		int tilesY = (height + tileSize - 1) / tileSize;
+		int side = 1;
+		while(side < std::max(tilesX, tilesY))
+			side *= 2;
+		tiles.clear();
+		for(int code = 0; code < side * side; code++)
+		{
+			int tx = Compact(code), ty = Compact(code >> 1);
+			if(tx >= tilesX || ty >= tilesY)
+				continue;
+			Tile t;
+			t.x0 = tx * tileSize;
+			t.y0 = ty * tileSize;
+			t.x1 = std::min(t.x0 + tileSize, width);
+			t.y1 = std::min(t.y0 + tileSize, height);
+			tiles.push_back(t);
+		}
+
+		Dispatch(tile);
+	}
+
+	// Calls range(begin, end) for runs of grain indices covering [0, count) on all threads,
+	// returning once every run is done. A run is a tile one row high, so it is shared out the same way
+	void For( int count, int grain, const std::function<void(int, int)>& range )
+	{
+		grain = std::max(grain, 1);
+		tiles.clear();
+		for(int begin = 0; begin < count; begin += grain)
+		{
+			Tile t;
+			t.x0 = begin;
+			t.y0 = 0;
+			t.x1 = std::min(begin + grain, count);
+			t.y1 = 1;
+			tiles.push_back(t);
+		}
+
+		Dispatch([&]( const Tile& t ){ range(t.x0, t.x1); });
+	}
+
+	// Index of the calling thread within the pool while it runs tiles, 0 for the one that called
+	// Run or For, and -1 outside them
+	static int CurrentThread()
+	{
+		return current;
+	}
+
+	void ResetStats()
+	{
+		for(size_t i = 0; i < stats.size(); i++)
+		{
+			stats[i].busy = 0.0;
+			stats[i].tiles = 0;
+			stats[i].steals = 0;
+		}
+		wall = 0.0;
+	}
+
+	const std::vector<TileThreadStats>& Stats() const
+	{
+		return stats;
+	}
+
+	// Seconds spent in Run and For since the stats were reset
+	double WallTime() const
+	{
+		return wall;
+	}
+
+private:
+	// A run [front, back) of tiles. Aligned so each thread's queue is on its own cache line
+	struct alignas(64) Queue
+	{
+		std::mutex lock;
+		int front, back;
+		Queue() : front(0), back(0){}
+	};
+
+	int threadCount;
+	std::vector<std::thread> workers;
+	std::vector<Queue> queues;
+	std::vector<Tile> tiles;
+	std::vector<TileThreadStats> stats;
+
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(const Tile&)>* job;
+	unsigned generation; // Counts jobs, so a waking thread can tell a new one has started
+	int active;          // Threads other than the caller still working on the job
+	bool quit;
+	double wall;
+
+	static inline thread_local int current = -1;
+
+	// Every other bit of code, starting from bit 0
+	static int Compact( int code )
+	{
+		int v = 0;
+		for(int bit = 0; (code >> (2*bit)) != 0; bit++)
+			v |= ((code >> (2*bit)) & 1) << bit;
+		return v;
+	}
+
+	// Shares the tiles out among the threads' queues, wakes the workers and runs job on them and
+	// on the calling thread until every queue is empty
+	void Dispatch( const std::function<void(const Tile&)>& tile )
+	{
+		auto start = std::chrono::steady_clock::now();
+
+		for(int i = 0; i < threadCount; i++)
+		{
+			queues[i].front = (int) (tiles.size() * i / threadCount);
+			queues[i].back = (int) (tiles.size() * (i + 1) / threadCount);
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			job = &tile;
+			active = threadCount - 1;
+			generation++;
+			wake.notify_all();
+		}
+
+		current = 0;
+		Process(0);
+		current = -1;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [this]{ return active == 0; });
+			job = 0;
+		}
+
+		wall += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Waits for jobs after the one numbered seen
+	void Work( int index, unsigned seen )
+	{
+		current = index;
+		while(true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&]{ return quit || generation != seen; });
+				if(quit)
+					return;
+				seen = generation;
+			}
+
+			Process(index);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			if(--active == 0)
+				done.notify_one();
+		}
+	}
+
+	// Runs tiles from the thread's own queue, then steals until every queue is empty
+	void Process( int index )
+	{
+		Queue& own = queues[index];
+		TileThreadStats& s = stats[index];
+		while(true)
+		{
+			int next = -1;
+			{
+				std::unique_lock<std::mutex> lock(own.lock);
+				if(own.front < own.back)
+					next = own.front++;
+			}
+			if(next < 0 && !Steal(index))
+				return;
+			if(next < 0)
+				continue;
+
+			auto start = std::chrono::steady_clock::now();
+			(*job)(tiles[next]);
+			s.busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			s.tiles++;
+		}
+	}
+
+	// Moves the back half of the fullest other queue into the thread's own. Returns false once
+	// there is nothing left to steal
+	bool Steal( int index )
+	{
+		while(true)
+		{
+			// The victim may have taken more tiles by the time it is locked again, so it is checked twice
+			int victim = -1, most = 0;
+			for(int i = 1; i < threadCount; i++)
+			{
+				int v = (index + i) % threadCount;
+				std::unique_lock<std::mutex> lock(queues[v].lock);
+				int size = queues[v].back - queues[v].front;
+				if(size > most)
+				{
+					most = size;
+					victim = v;
+				}
+			}
+			if(victim < 0)
+				return false;
+
+			int first, last;
+			{
+				std::unique_lock<std::mutex> lock(queues[victim].lock);
+				int size = queues[victim].back - queues[victim].front;
+				if(size <= 0)
+					continue;
+				last = queues[victim].back;
+				first = last - (size + 1) / 2;
+				queues[victim].back = first;
+			}
+
+			std::unique_lock<std::mutex> lock(queues[index].lock);
+			queues[index].front = first;
+			queues[index].back = last;
+			stats[index].steals++;
+			return true;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,313 @@
+#ifndef TRIANGLE_STORE_H
+#define TRIANGLE_STORE_H
+
+// Packed structure-of-arrays copy of the scene triangles used by the intersection kernels.
+// The first vertex, both edges and the unnormalised normal cross(e1,e2) are precomputed when
+// the scene changes, so a ray/triangle test is only the Cramer's rule dot products.
+// Ranges of triangles are tested SIMD_WIDTH at a time: 8 with AVX, 4 with SSE, 1 otherwise.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include "TestModel.h"
+
+#if defined(__AVX__)
+	#include <immintrin.h>
+	#define SIMD_WIDTH 8
+#elif defined(__SSE2__)
+	#include <emmintrin.h>
+	#define SIMD_WIDTH 4
+#else
+	#define SIMD_WIDTH 1
+#endif
+
+// Result of a ray query. t is measured in multiples of the ray direction, u and v are
+// the barycentric coordinates along the triangle edges v1-v0 and v2-v0
+struct Hit
+{
+	float t;
+	float u;
+	float v;
+	int triangleIndex;
+	int instanceIndex; // -1 for the world triangles, otherwise triangleIndex is into the instance's mesh
+};
+
+#if SIMD_WIDTH == 8
+	typedef __m256 simdf;
+	inline simdf SimdLoad( const float* p ) { return _mm256_loadu_ps(p); }
+	inline simdf SimdSet( float f ) { return _mm256_set1_ps(f); }
+	inline simdf SimdAdd( simdf a, simdf b ) { return _mm256_add_ps(a, b); }
+	inline simdf SimdSub( simdf a, simdf b ) { return _mm256_sub_ps(a, b); }
+	inline simdf SimdMul( simdf a, simdf b ) { return _mm256_mul_ps(a, b); }
+	inline simdf SimdDiv( simdf a, simdf b ) { return _mm256_div_ps(a, b); }
+	inline simdf SimdMin( simdf a, simdf b ) { return _mm256_min_ps(a, b); }
+	inline simdf SimdMax( simdf a, simdf b ) { return _mm256_max_ps(a, b); }
+	inline simdf SimdAnd( simdf a, simdf b ) { return _mm256_and_ps(a, b); }
+	inline simdf SimdLess( simdf a, simdf b ) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	inline simdf SimdLessEqual( simdf a, simdf b ) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	inline simdf SimdGreater( simdf a, simdf b ) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	inline simdf SimdGreaterEqual( simdf a, simdf b ) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	inline int SimdMask( simdf a ) { return _mm256_movemask_ps(a); }
+	inline void SimdStore( float* p, simdf a ) { _mm256_storeu_ps(p, a); }
+#elif SIMD_WIDTH == 4
+	typedef __m128 simdf;
+	inline simdf SimdLoad( const float* p ) { return _mm_loadu_ps(p); }
+	inline simdf SimdSet( float f ) { return _mm_set1_ps(f); }
+	inline simdf SimdAdd( simdf a, simdf b ) { return _mm_add_ps(a, b); }
+	inline simdf SimdSub( simdf a, simdf b ) { return _mm_sub_ps(a, b); }
+	inline simdf SimdMul( simdf a, simdf b ) { return _mm_mul_ps(a, b); }
+	inline simdf SimdDiv( simdf a, simdf b ) { return _mm_div_ps(a, b); }
+	inline simdf SimdMin( simdf a, simdf b ) { return _mm_min_ps(a, b); }
+	inline simdf SimdMax( simdf a, simdf b ) { return _mm_max_ps(a, b); }
+	inline simdf SimdAnd( simdf a, simdf b ) { return _mm_and_ps(a, b); }
+	inline simdf SimdLess( simdf a, simdf b ) { return _mm_cmplt_ps(a, b); }
+	inline simdf SimdLessEqual( simdf a, simdf b ) { return _mm_cmple_ps(a, b); }
+	inline simdf SimdGreater( simdf a, simdf b ) { return _mm_cmpgt_ps(a, b); }
+	inline simdf SimdGreaterEqual( simdf a, simdf b ) { return _mm_cmpge_ps(a, b); }
+	inline int SimdMask( simdf a ) { return _mm_movemask_ps(a); }
+	inline void SimdStore( float* p, simdf a ) { _mm_storeu_ps(p, a); }
+#endif
+
+class TriangleStore
+{
+public:
+	int count;
+	std::vector<float> v0x, v0y, v0z;
+	std::vector<float> e1x, e1y, e1z;
+	std::vector<float> e2x, e2y, e2z;
+	std::vector<float> nx, ny, nz;    // cross(e1,e2), not normalised
+	std::vector<int> triangleIndex;   // Index of the source triangle in the scene list
+
+	TriangleStore() : count(0){}
+
+	// Packs the triangles in the order given by indices, so acceleration structures can
+	// store their leaves as contiguous ranges
+	void Build( const std::vector<Triangle>& triangles, const std::vector<int>& indices )
+	{
+		count = indices.size();
+
+		// Pad by a full SIMD register so the last range can always be loaded whole
+		int padded = count + SIMD_WIDTH;
+		std::vector<float>* arrays[] = { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &nx, &ny, &nz };
+		for(int a = 0; a < 12; a++)
+			arrays[a]->assign(padded, 0.0f);
+		triangleIndex.assign(padded, -1);
+
+		#pragma omp parallel for schedule(static)
+		for(int i = 0; i < count; i++)
+		{
+			triangleIndex[i] = indices[i];
+			Set(i, triangles[indices[i]]);
+		}
+	}
+
+	// Recomputes the precomputed data of every packed triangle from the scene list
+	void Update( const std::vector<Triangle>& triangles )
+	{
+		#pragma omp parallel for schedule(static)
+		for(int i = 0; i < count; i++)
+			Set(i, triangles[triangleIndex[i]]);
+	}
+
+	// Scalar reference path. Tests triangles [first, first+n) and keeps the closest hit with t < hit.t
+	bool IntersectRangeScalar( int first, int n, const glm::vec3& start, const glm::vec3& dir, Hit& hit ) const
+	{
+		bool found = false;
+		for(int i = first; i < first + n; i++)
+		{
+			float t, u, v;
+			if(IntersectOne(i, start, dir, t, u, v) && t < hit.t)
+			{
+				hit.t = t;
+				hit.u = u;
+				hit.v = v;
+				hit.triangleIndex = triangleIndex[i];
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	// Scalar reference path for shadow rays. If blocker is given it is set to the scene index of the triangle that blocked the ray
+	bool OccludedRangeScalar( int first, int n, const glm::vec3& start, const glm::vec3& dir, float tMin, float tMax, int* blocker = 0 ) const
+	{
+		for(int i = first; i < first + n; i++)
+		{
+			float t, u, v;
+			if(IntersectOne(i, start, dir, t, u, v) && t > tMin && t < tMax)
+			{
+				if(blocker)
+					*blocker = triangleIndex[i];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Shadow ray test against a single unpacked triangle. Does the same arithmetic as the packed
+	// kernels, so it agrees with them on whether the triangle blocks the ray
+	static bool OccludedBy( const Triangle& tri, const glm::vec3& start, const glm::vec3& dir, float tMin, float tMax )
+	{
+		glm::vec3 e1 = tri.v1 - tri.v0;
+		glm::vec3 e2 = tri.v2 - tri.v0;
+		float t, u, v;
+		return Cramer(tri.v0, e1, e2, glm::cross(e1, e2), start, dir, t, u, v) && t > tMin && t < tMax;
+	}
+
+	// Cramer's rule on a triangle given as its first vertex, its edges and n = cross(e1,e2). Sets t, u
+	// and v even when the ray misses, which gives the point on the triangle's plane
+	static bool Cramer( const glm::vec3& v0, const glm::vec3& e1, const glm::vec3& e2, const glm::vec3& n,
+						const glm::vec3& start, const glm::vec3& dir, float& t, float& u, float& v )
+	{
+		glm::vec3 b = start - v0;
+
+		//anticommutative
+		glm::vec3 be2 = glm::cross(b,e2);
+		glm::vec3 e1b = glm::cross(e1,b);
+
+		glm::vec3 negD = -dir;
+
+		float e1e2b = n.x*b.x+n.y*b.y+n.z*b.z;
+		float e1e2d = n.x*negD.x+n.y*negD.y+n.z*negD.z;
+		float be2d =  be2.x*negD.x+be2.y*negD.y+be2.z*negD.z;
+		float e1bd =  e1b.x*negD.x+e1b.y*negD.y+e1b.z*negD.z;
+
+		// checking constraints for point to be in triangle
+		t = e1e2b/e1e2d;
+		u = be2d/e1e2d;
+		v = e1bd/e1e2d;
+
+		return (u+v <= 1.0f && u >= 0.0f && v >= 0.0f && t >= 0.0f);
+	}
+
+#if SIMD_WIDTH > 1
+	// Tests triangles [first, first+n) SIMD_WIDTH at a time and keeps the closest hit with t < hit.t.
+	// Does exactly the same arithmetic as the scalar path so both return the same hit.
+	bool IntersectRange( int first, int n, const glm::vec3& start, const glm::vec3& dir, Hit& hit ) const
+	{
+		bool found = false;
+		for(int base = first; base < first + n; base += SIMD_WIDTH)
+		{
+			simdf t, u, v;
+			int mask = IntersectPacked(base, first + n - base, start, dir, t, u, v);
+			if(mask == 0)
+				continue;
+
+			// Lanes are checked in order so ties resolve to the same triangle as the scalar loop
+			float ts[SIMD_WIDTH], us[SIMD_WIDTH], vs[SIMD_WIDTH];
+			SimdStore(ts, t);
+			SimdStore(us, u);
+			SimdStore(vs, v);
+			for(int k = 0; k < SIMD_WIDTH; k++)
+			{
+				if((mask & (1 << k)) && ts[k] < hit.t)
+				{
+					hit.t = ts[k];
+					hit.u = us[k];
+					hit.v = vs[k];
+					hit.triangleIndex = triangleIndex[base + k];
+					found = true;
+				}
+			}
+		}
+		return found;
+	}
+
+	bool OccludedRange( int first, int n, const glm::vec3& start, const glm::vec3& dir, float tMin, float tMax, int* blocker = 0 ) const
+	{
+		simdf vMin = SimdSet(tMin);
+		simdf vMax = SimdSet(tMax);
+		for(int base = first; base < first + n; base += SIMD_WIDTH)
+		{
+			simdf t, u, v;
+			int mask = IntersectPacked(base, first + n - base, start, dir, t, u, v);
+			mask &= SimdMask(SimdAnd(SimdGreater(t, vMin), SimdLess(t, vMax)));
+			if(mask == 0)
+				continue;
+
+			// Report the first blocking lane, as the scalar loop would
+			if(blocker)
+			{
+				int k = 0;
+				while(!(mask & (1 << k)))
+					k++;
+				*blocker = triangleIndex[base + k];
+			}
+			return true;
+		}
+		return false;
+	}
+#else
+	bool IntersectRange( int first, int n, const glm::vec3& start, const glm::vec3& dir, Hit& hit ) const
+	{
+		return IntersectRangeScalar(first, n, start, dir, hit);
+	}
+
+	bool OccludedRange( int first, int n, const glm::vec3& start, const glm::vec3& dir, float tMin, float tMax, int* blocker = 0 ) const
+	{
+		return OccludedRangeScalar(first, n, start, dir, tMin, tMax, blocker);
+	}
+#endif
+
+private:
+	void Set( int i, const Triangle& tri )
+	{
+		glm::vec3 e1 = tri.v1 - tri.v0;
+		glm::vec3 e2 = tri.v2 - tri.v0;
+		glm::vec3 n = glm::cross(e1, e2);
+		v0x[i] = tri.v0.x; v0y[i] = tri.v0.y; v0z[i] = tri.v0.z;
+		e1x[i] = e1.x; e1y[i] = e1.y; e1z[i] = e1.z;
+		e2x[i] = e2.x; e2y[i] = e2.y; e2z[i] = e2.z;
+		nx[i] = n.x; ny[i] = n.y; nz[i] = n.z;
+	}
+
+	// Cramer's rule on one packed triangle
+	bool IntersectOne( int i, const glm::vec3& start, const glm::vec3& dir, float& t, float& u, float& v ) const
+	{
+		return Cramer(glm::vec3(v0x[i], v0y[i], v0z[i]), glm::vec3(e1x[i], e1y[i], e1z[i]), glm::vec3(e2x[i], e2y[i], e2z[i]),
+					  glm::vec3(nx[i], ny[i], nz[i]), start, dir, t, u, v);
+	}
+
+#if SIMD_WIDTH > 1
+	// Cramer's rule on SIMD_WIDTH packed triangles starting at base. Returns a bit mask of the
+	// lanes that hit, ignoring lanes at or past valid
+	int IntersectPacked( int base, int valid, const glm::vec3& start, const glm::vec3& dir, simdf& t, simdf& u, simdf& v ) const
+	{
+		simdf bx = SimdSub(SimdSet(start.x), SimdLoad(&v0x[base]));
+		simdf by = SimdSub(SimdSet(start.y), SimdLoad(&v0y[base]));
+		simdf bz = SimdSub(SimdSet(start.z), SimdLoad(&v0z[base]));
+		simdf ax = SimdLoad(&e1x[base]), ay = SimdLoad(&e1y[base]), az = SimdLoad(&e1z[base]);
+		simdf cx = SimdLoad(&e2x[base]), cy = SimdLoad(&e2y[base]), cz = SimdLoad(&e2z[base]);
+		simdf dx = SimdSet(-dir.x), dy = SimdSet(-dir.y), dz = SimdSet(-dir.z);
+
+		// cross(b,e2) and cross(e1,b), operand order matching glm::cross
+		simdf be2x = SimdSub(SimdMul(by, cz), SimdMul(cy, bz));
+		simdf be2y = SimdSub(SimdMul(bz, cx), SimdMul(cz, bx));
+		simdf be2z = SimdSub(SimdMul(bx, cy), SimdMul(cx, by));
+		simdf e1bx = SimdSub(SimdMul(ay, bz), SimdMul(by, az));
+		simdf e1by = SimdSub(SimdMul(az, bx), SimdMul(bz, ax));
+		simdf e1bz = SimdSub(SimdMul(ax, by), SimdMul(bx, ay));
+
+		simdf nvx = SimdLoad(&nx[base]), nvy = SimdLoad(&ny[base]), nvz = SimdLoad(&nz[base]);
+		simdf e1e2b = SimdAdd(SimdAdd(SimdMul(nvx, bx), SimdMul(nvy, by)), SimdMul(nvz, bz));
+		simdf e1e2d = SimdAdd(SimdAdd(SimdMul(nvx, dx), SimdMul(nvy, dy)), SimdMul(nvz, dz));
+		simdf be2d = SimdAdd(SimdAdd(SimdMul(be2x, dx), SimdMul(be2y, dy)), SimdMul(be2z, dz));
+		simdf e1bd = SimdAdd(SimdAdd(SimdMul(e1bx, dx), SimdMul(e1by, dy)), SimdMul(e1bz, dz));
+
+		t = SimdDiv(e1e2b, e1e2d);
+		u = SimdDiv(be2d, e1e2d);
+		v = SimdDiv(e1bd, e1e2d);
+
+		simdf zero = SimdSet(0.0f);
+		simdf inside = SimdAnd(SimdAnd(SimdLessEqual(SimdAdd(u, v), SimdSet(1.0f)), SimdGreaterEqual(u, zero)),
+							   SimdAnd(SimdGreaterEqual(v, zero), SimdGreaterEqual(t, zero)));
+
+		int mask = SimdMask(inside);
+		if(valid < SIMD_WIDTH)
+			mask &= (1 << valid) - 1;
+		return mask;
+	}
+#endif
+};
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef VISIBILITY_BUFFER_H
+#define VISIBILITY_BUFFER_H
+
+// Rasterised primary visibility: the index of the nearest triangle under every pixel and its
+// depth. Triangles are moved into camera space and each pixel is tested at the point its primary
+// ray passes through, using one edge function per edge: the dot product of the pixel's ray with
+// the normal of the plane through the camera and that edge. The edge functions and the depth
+// 1/t are linear in the pixel position and work for triangles that reach behind the camera, so
+// nothing has to be clipped. Shading is left to the caller, which can find the exact hit by
+// intersecting the pixel's ray with the one triangle stored here.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "TestModel.h"
+#include "TilePool.h"
+
+class VisibilityBuffer
+{
+public:
+	int width, height;
+	std::vector<float> depth;  // 1/t of the nearest hit along the pixel's ray, 0 where nothing covers the pixel
+	std::vector<int> triangle; // Index of the nearest triangle, -1 where nothing covers the pixel
+	std::vector<int> instance; // Instance it belongs to, -1 for the scene triangles
+
+	VisibilityBuffer() : width(0), height(0), focalLength(0.0f), offsetX(0.0f), offsetY(0.0f){}
+
+	// Starts a frame for a camera whose primary ray through pixel (x,y) has direction
+	// cameraRot * (x + offsetX - width/2, y + offsetY - height/2, focalLength)
+	void Begin( int w, int h, float focal, const glm::vec3& position, const glm::mat3& rotation, float ox, float oy )
+	{
+		width = w;
+		height = h;
+		focalLength = focal;
+		cameraPos = position;
+		cameraRot = rotation;
+		offsetX = ox;
+		offsetY = oy;
+		screenTriangles.clear();
+	}
+
+	// Sets up the triangles for rasterising on the pool's threads. With a transform they are an
+	// instance's mesh triangles and are moved into the world first
+	void AddTriangles( TilePool& pool, const std::vector<Triangle>& triangles, int instanceIndex = -1, const glm::mat4* transform = 0 )
+	{
+		size_t first = screenTriangles.size();
+		screenTriangles.resize(first + triangles.size());
+
+		pool.For(triangles.size(), 1024, [&]( int begin, int end )
+		{
+			for(int i = begin; i < end; i++)
+			{
+				glm::vec3 v[3] = { triangles[i].v0, triangles[i].v1, triangles[i].v2 };
+				if(transform)
+				{
+					for(int k = 0; k < 3; k++)
+						v[k] = glm::vec3(*transform * glm::vec4(v[k], 1.0f));
+				}
+				Setup(v, i, instanceIndex, screenTriangles[first + i]);
+			}
+		});
+	}
+
+	// Scan converts every triangle added since Begin, a band of rows at a time on the pool's threads
+	void Rasterise( TilePool& pool )
+	{
+		depth.assign(width * height, 0.0f);
+		triangle.assign(width * height, -1);
+		instance.assign(width * height, -1);
+
+		// Bin the triangles by the bands of rows they touch, keeping them in the order they were
+		// added so ties in depth always go the same way
+		int bands = (height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+		std::vector<int> bandStart(bands + 1, 0);
+		for(size_t i = 0; i < screenTriangles.size(); i++)
+		{
+			const ScreenTriangle& s = screenTriangles[i];
+			for(int b = s.minY / BAND_HEIGHT; s.minX <= s.maxX && b <= s.maxY / BAND_HEIGHT; b++)
+				bandStart[b + 1]++;
+		}
+		for(int b = 0; b < bands; b++)
+			bandStart[b + 1] += bandStart[b];
+
+		std::vector<int> binned(bandStart[bands]);
+		std::vector<int> next(bandStart.begin(), bandStart.end() - 1);
+		for(size_t i = 0; i < screenTriangles.size(); i++)
+		{
+			const ScreenTriangle& s = screenTriangles[i];
+			for(int b = s.minY / BAND_HEIGHT; s.minX <= s.maxX && b <= s.maxY / BAND_HEIGHT; b++)
+				binned[next[b]++] = i;
+		}
+
+		pool.For(bands, 1, [&]( int begin, int end )
+		{
+			for(int b = begin; b < end; b++)
+			{
+				int bandTop = b * BAND_HEIGHT;
+				int bandBottom = std::min(bandTop + BAND_HEIGHT, height) - 1;
+				for(int k = bandStart[b]; k < bandStart[b + 1]; k++)
+					Scan(screenTriangles[binned[k]], std::max(bandTop, screenTriangles[binned[k]].minY),
+						 std::min(bandBottom, screenTriangles[binned[k]].maxY));
+			}
+		});
+	}
+
+	size_t Triangles() const
+	{
+		return screenTriangles.size();
+	}
+
+private:
+	static const int BAND_HEIGHT = 8;
+
+	// A triangle ready to scan. Each function is evaluated as a dot product with the pixel's
+	// camera space ray (x + offsetX - width/2, y + offsetY - height/2, focalLength)
+	struct ScreenTriangle
+	{
+		glm::vec3 edge[3];  // Positive on the inside of each edge
+		glm::vec3 inverseT; // 1/t of the hit on the triangle's plane
+		int minX, maxX, minY, maxY; // Pixels that can be covered, empty if minX > maxX
+		int triangle, instance;
+	};
+
+	float focalLength;
+	glm::vec3 cameraPos;
+	glm::mat3 cameraRot;
+	float offsetX, offsetY;
+	std::vector<ScreenTriangle> screenTriangles;
+
+	void Setup( const glm::vec3 world[3], int triangleIndex, int instanceIndex, ScreenTriangle& s ) const
+	{
+		s.triangle = triangleIndex;
+		s.instance = instanceIndex;
+		s.minX = 0;
+		s.maxX = -1;
+		s.minY = 0;
+		s.maxY = -1;
+
+		// Camera space, the inverse of the rotation applied to the primary rays
+		glm::vec3 v[3];
+		for(int k = 0; k < 3; k++)
+			v[k] = (world[k] - cameraPos) * cameraRot;
+
+		// Triangles seen edge on, or whose plane passes through the camera, cover nothing
+		glm::vec3 n = glm::cross(v[1] - v[0], v[2] - v[0]);
+		float planeDistance = glm::dot(n, v[0]);
+		if(planeDistance == 0.0f)
+			return;
+
+		// The edge planes point inwards for either winding once flipped by the side the camera is on
+		float side = planeDistance > 0.0f ? 1.0f : -1.0f;
+		for(int k = 0; k < 3; k++)
+			s.edge[k] = glm::cross(v[k], v[(k + 1) % 3]) * side;
+		s.inverseT = n / planeDistance;
+
+		// Bounds of the projected vertices. A triangle reaching behind the camera can cover
+		// any pixel, so it is scanned over the whole screen
+		float x0 = width / 2.0f - offsetX;
+		float y0 = height / 2.0f - offsetY;
+		float minX = width, maxX = -1.0f, minY = height, maxY = -1.0f;
+		bool inFront = true;
+		for(int k = 0; k < 3; k++)
+		{
+			if(v[k].z <= 0.0f)
+			{
+				inFront = false;
+				break;
+			}
+			float x = focalLength * v[k].x / v[k].z + x0;
+			float y = focalLength * v[k].y / v[k].z + y0;
+			minX = std::min(minX, x);
+			maxX = std::max(maxX, x);
+			minY = std::min(minY, y);
+			maxY = std::max(maxY, y);
+		}
+		if(!inFront)
+		{
+			minX = 0.0f;
+			maxX = width - 1;
+			minY = 0.0f;
+			maxY = height - 1;
+		}
+
+		// Clamped before the conversion, as a vertex just in front of the camera can project
+		// far outside the range of an int
+		minX = std::min(std::max(minX, -1.0f), (float) width);
+		maxX = std::min(std::max(maxX, -1.0f), (float) width);
+		minY = std::min(std::max(minY, -1.0f), (float) height);
+		maxY = std::min(std::max(maxY, -1.0f), (float) height);
+
+		s.minX = std::max(0, (int) floorf(minX));
+		s.maxX = std::min(width - 1, (int) ceilf(maxX));
+		s.minY = std::max(0, (int) floorf(minY));
+		s.maxY = std::min(height - 1, (int) ceilf(maxY));
+		if(s.minY > s.maxY)
+			s.maxX = s.minX - 1;
+	}
+
+	// Tests rows [top, bottom] of the triangle's bounds, keeping the nearest hit in front of the camera
+	void Scan( const ScreenTriangle& s, int top, int bottom )
+	{
+		for(int y = top; y <= bottom; y++)
+		{
+			for(int x = s.minX; x <= s.maxX; x++)
+			{
+				glm::vec3 ray(x + offsetX - width / 2.0f, y + offsetY - height / 2.0f, focalLength);
+				if(glm::dot(s.edge[0], ray) < 0.0f || glm::dot(s.edge[1], ray) < 0.0f || glm::dot(s.edge[2], ray) < 0.0f)
+					continue;
+
+				float w = glm::dot(s.inverseT, ray);
+				int p = y * width + x;
+				if(w > depth[p])
+				{
+					depth[p] = w;
+					triangle[p] = s.triangle;
+					instance[p] = s.instance;
+				}
+			}
+		}
+	}
+};
+
+#endif
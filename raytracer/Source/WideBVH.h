@@ -0,0 +1,431 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+// 4-wide BVH collapsed from the binary BVH. Each node keeps the bounds of its four children
+// in structure-of-arrays form, so a single SSE slab test checks all of them at once and a ray
+// touches half as many nodes (and cache lines) on its way down. Leaves reference the same
+// triangle store ranges as the binary BVH they were collapsed from.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include "AABB.h"
+#include "BVH.h"
+#include "RayPacket.h"
+#include "TriangleStore.h"
+
+#if SIMD_WIDTH > 1
+	#include <xmmintrin.h>
+#endif
+
+#if SIMD_WIDTH > 1
+// Ray data broadcast into SSE registers
+struct SlabRay
+{
+	__m128 ox, oy, oz;
+	__m128 ix, iy, iz;
+
+	SlabRay( const RayBoxData& ray )
+	{
+		ox = _mm_set1_ps(ray.origin.x); oy = _mm_set1_ps(ray.origin.y); oz = _mm_set1_ps(ray.origin.z);
+		ix = _mm_set1_ps(ray.invDir.x); iy = _mm_set1_ps(ray.invDir.y); iz = _mm_set1_ps(ray.invDir.z);
+	}
+};
+
+// Slab test against four boxes at once. Returns a bit mask of the boxes hit closer than tMax
+// and their entry distances
+inline int IntersectBoxes4( __m128 minX, __m128 minY, __m128 minZ, __m128 maxX, __m128 maxY, __m128 maxZ,
+							const SlabRay& ray, float tMax, float dist[4] )
+{
+	__m128 t1x = _mm_mul_ps(_mm_sub_ps(minX, ray.ox), ray.ix);
+	__m128 t2x = _mm_mul_ps(_mm_sub_ps(maxX, ray.ox), ray.ix);
+	__m128 t1y = _mm_mul_ps(_mm_sub_ps(minY, ray.oy), ray.iy);
+	__m128 t2y = _mm_mul_ps(_mm_sub_ps(maxY, ray.oy), ray.iy);
+	__m128 t1z = _mm_mul_ps(_mm_sub_ps(minZ, ray.oz), ray.iz);
+	__m128 t2z = _mm_mul_ps(_mm_sub_ps(maxZ, ray.oz), ray.iz);
+
+	__m128 tEnter = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1x, t2x), _mm_min_ps(t1y, t2y)),
+							   _mm_max_ps(_mm_min_ps(t1z, t2z), _mm_setzero_ps()));
+	__m128 tExit = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1x, t2x), _mm_max_ps(t1y, t2y)),
+							  _mm_min_ps(_mm_max_ps(t1z, t2z), _mm_set1_ps(tMax)));
+
+	_mm_storeu_ps(dist, tEnter);
+	return _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit));
+}
+#else
+typedef RayBoxData SlabRay;
+
+// The SSE min and max, which return the second value when either is NaN
+inline float SlabMin( float a, float b ) { return a < b ? a : b; }
+inline float SlabMax( float a, float b ) { return a > b ? a : b; }
+
+// The same slab test one box at a time, in the same order of operations as the SSE version
+inline int IntersectBoxes4( const float minX[4], const float minY[4], const float minZ[4],
+							const float maxX[4], const float maxY[4], const float maxZ[4],
+							const SlabRay& ray, float tMax, float dist[4] )
+{
+	int mask = 0;
+	for(int i = 0; i < 4; i++)
+	{
+		float t1x = (minX[i] - ray.origin.x) * ray.invDir.x;
+		float t2x = (maxX[i] - ray.origin.x) * ray.invDir.x;
+		float t1y = (minY[i] - ray.origin.y) * ray.invDir.y;
+		float t2y = (maxY[i] - ray.origin.y) * ray.invDir.y;
+		float t1z = (minZ[i] - ray.origin.z) * ray.invDir.z;
+		float t2z = (maxZ[i] - ray.origin.z) * ray.invDir.z;
+
+		float tEnter = SlabMax(SlabMax(SlabMin(t1x, t2x), SlabMin(t1y, t2y)), SlabMax(SlabMin(t1z, t2z), 0.0f));
+		float tExit = SlabMin(SlabMin(SlabMax(t1x, t2x), SlabMax(t1y, t2y)), SlabMin(SlabMax(t1z, t2z), tMax));
+		dist[i] = tEnter;
+		if(tEnter <= tExit)
+			mask |= 1 << i;
+	}
+	return mask;
+}
+#endif
+
+// Pushes the children in mask so the nearest is on top of the stack. Leaves are pushed with
+// the high bit set and nodeIdx * 4 + slot, interior children as their node index
+template<class Node>
+void PushOrdered4( const Node& node, int nodeIdx, int mask, const float dist[4], int* stack, float* stackDist, int& stackSize )
+{
+	int order[4];
+	int n = 0;
+	for(int i = 0; i < 4; i++)
+	{
+		if(!(mask & (1 << i)))
+			continue;
+		int k = n++;
+		while(k > 0 && dist[order[k-1]] < dist[i])
+		{
+			order[k] = order[k-1];
+			k--;
+		}
+		order[k] = i;
+	}
+
+	for(int k = 0; k < n; k++)
+	{
+		int i = order[k];
+		stack[stackSize] = node.count[i] > 0 ? (int)(0x80000000u | (unsigned)(nodeIdx * 4 + i)) : node.child[i];
+		stackDist[stackSize++] = dist[i];
+	}
+}
+
+struct WideBVHNode
+{
+	float minX[4], minY[4], minZ[4];
+	float maxX[4], maxY[4], maxZ[4];
+	int child[4]; // Index of the child node, or the first triangle in the store for leaves
+	int count[4]; // 0 for interior children, number of triangles for leaves, -1 for empty slots
+
+	AABB ChildBounds( int i ) const
+	{
+		AABB box;
+		box.min = glm::vec3(minX[i], minY[i], minZ[i]);
+		box.max = glm::vec3(maxX[i], maxY[i], maxZ[i]);
+		return box;
+	}
+};
+
+class WideBVH
+{
+public:
+	std::vector<WideBVHNode> nodes;
+	std::vector<int> sources; // Binary node each child slot was collapsed from, four per node, -1 for empty slots
+	AABB rootBounds;
+	int depth;
+
+	WideBVH() : depth(0){}
+
+	// Collapses a binary BVH by pulling grandchildren up into each node until it has four children
+	void Build( const BVH& bvh )
+	{
+		nodes.clear();
+		sources.clear();
+		depth = 0;
+		if(bvh.nodes.empty() || bvh.triIndices.empty())
+			return;
+
+		rootBounds = bvh.nodes[0].bounds;
+		nodes.reserve(bvh.nodes.size() / 2 + 1);
+
+		if(bvh.nodes[0].count > 0)
+		{
+			// A single leaf still needs a root node to live in
+			nodes.push_back(WideBVHNode());
+			sources.resize(4, -1);
+			int slots[1] = { 0 };
+			Fill(bvh, 0, slots, 1, 1);
+		}
+		else
+			Collapse(bvh, 0, 1);
+	}
+
+	// Copies the bounds of a refit binary BVH. The binary BVH must be the one this was built
+	// from, refit rather than rebuilt, so the slots still map to the same nodes
+	void Refit( const BVH& bvh )
+	{
+		if(nodes.empty())
+			return;
+
+		rootBounds = bvh.nodes[0].bounds;
+
+		#pragma omp parallel for schedule(static)
+		for(int n = 0; n < (int)nodes.size(); n++)
+		{
+			WideBVHNode& node = nodes[n];
+			for(int i = 0; i < 4; i++)
+			{
+				if(sources[n*4 + i] < 0)
+					continue;
+				const AABB& b = bvh.nodes[sources[n*4 + i]].bounds;
+				node.minX[i] = b.min.x; node.minY[i] = b.min.y; node.minZ[i] = b.min.z;
+				node.maxX[i] = b.max.x; node.maxY[i] = b.max.y; node.maxZ[i] = b.max.z;
+			}
+		}
+	}
+
+	// Finds the closest hit with t < hit.t. hit.t should be initialised to the maximum distance.
+	bool Intersect( const TriangleStore& store, const glm::vec3& start, const glm::vec3& dir, Hit& hit ) const
+	{
+		if(nodes.empty())
+			return false;
+
+		RayBoxData ray(start, dir);
+		if(IntersectAABB(ray, rootBounds, hit.t) == std::numeric_limits<float>::max())
+			return false;
+
+		SlabRay slab(ray);
+		bool found = false;
+
+		// Leaves are pushed with the high bit set so one stack holds both kinds of entry
+		int stack[64 * 3];
+		float stackDist[64 * 3];
+		int stackSize = 0;
+		stack[stackSize] = 0;
+		stackDist[stackSize++] = 0.0f;
+
+		while(stackSize > 0)
+		{
+			stackSize--;
+			if(stackDist[stackSize] >= hit.t)
+				continue;
+
+			int entry = stack[stackSize];
+			if(entry < 0)
+			{
+				int leaf = entry & 0x7fffffff;
+				const WideBVHNode& node = nodes[leaf >> 2];
+				if(store.IntersectRange(node.child[leaf & 3], node.count[leaf & 3], start, dir, hit))
+					found = true;
+				continue;
+			}
+
+			float dist[4];
+			int mask = IntersectChildren(nodes[entry], slab, hit.t, dist);
+			PushOrdered4(nodes[entry], entry, mask, dist, stack, stackDist, stackSize);
+		}
+
+		return found;
+	}
+
+	// Returns true as soon as any triangle is hit with tMin < t < tMax
+	bool Occluded( const TriangleStore& store, const glm::vec3& start, const glm::vec3& dir, float tMin, float tMax, int* blocker = 0 ) const
+	{
+		if(nodes.empty())
+			return false;
+
+		RayBoxData ray(start, dir);
+		if(IntersectAABB(ray, rootBounds, tMax) == std::numeric_limits<float>::max())
+			return false;
+
+		SlabRay slab(ray);
+		int stack[64 * 3];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while(stackSize > 0)
+		{
+			const WideBVHNode& node = nodes[stack[--stackSize]];
+			float dist[4];
+			int mask = IntersectChildren(node, slab, tMax, dist);
+			for(int i = 0; i < 4; i++)
+			{
+				if(!(mask & (1 << i)))
+					continue;
+				if(node.count[i] > 0)
+				{
+					if(store.OccludedRange(node.child[i], node.count[i], start, dir, tMin, tMax, blocker))
+						return true;
+				}
+				else
+					stack[stackSize++] = node.child[i];
+			}
+		}
+
+		return false;
+	}
+
+	// Packet version of Intersect. Works like BVH::IntersectPacket, with each child box
+	// checked from the first ray that hit the parent
+	void IntersectPacket( const TriangleStore& store, RayPacket& packet ) const
+	{
+		if(nodes.empty() || packet.count == 0)
+			return;
+
+		int first = packet.FirstHit(rootBounds, 0);
+		if(first == packet.count)
+			return;
+
+		int stackNode[64 * 3];
+		int stackFirst[64 * 3];
+		int stackSize = 0;
+		stackNode[stackSize] = 0;
+		stackFirst[stackSize++] = first;
+
+		while(stackSize > 0)
+		{
+			stackSize--;
+			// Every ray before parentFirst already missed this node
+			const WideBVHNode& node = nodes[stackNode[stackSize]];
+			int parentFirst = stackFirst[stackSize];
+
+			// Order the children by the distance along the first live ray
+			int order[4];
+			int firsts[4];
+			float dist[4];
+			int n = 0;
+			for(int i = 0; i < 4; i++)
+			{
+				if(node.count[i] < 0)
+					continue;
+				AABB box = node.ChildBounds(i);
+				int childFirst = packet.FirstHit(box, parentFirst);
+				if(childFirst == packet.count)
+					continue;
+
+				if(node.count[i] > 0)
+				{
+					for(int r = childFirst; r < packet.count; r++)
+					{
+						if(IntersectAABB(packet.rays[r], box, packet.hit[r].t) != std::numeric_limits<float>::max())
+							store.IntersectRange(node.child[i], node.count[i], packet.origin, packet.dir[r], packet.hit[r]);
+					}
+					continue;
+				}
+
+				float d = IntersectAABB(packet.rays[childFirst], box, std::numeric_limits<float>::max());
+				int k = n++;
+				while(k > 0 && dist[k-1] < d)
+				{
+					order[k] = order[k-1];
+					firsts[k] = firsts[k-1];
+					dist[k] = dist[k-1];
+					k--;
+				}
+				order[k] = i;
+				firsts[k] = childFirst;
+				dist[k] = d;
+			}
+
+			// Push far to near so the nearest child is popped first
+			for(int k = 0; k < n; k++)
+			{
+				stackNode[stackSize] = node.child[order[k]];
+				stackFirst[stackSize++] = firsts[k];
+			}
+		}
+	}
+
+private:
+	// Slab test against all four children, with empty slots never counting as hit
+	static int IntersectChildren( const WideBVHNode& node, const SlabRay& ray, float tMax, float dist[4] )
+	{
+#if SIMD_WIDTH > 1
+		int mask = IntersectBoxes4(_mm_loadu_ps(node.minX), _mm_loadu_ps(node.minY), _mm_loadu_ps(node.minZ),
+								   _mm_loadu_ps(node.maxX), _mm_loadu_ps(node.maxY), _mm_loadu_ps(node.maxZ), ray, tMax, dist);
+#else
+		int mask = IntersectBoxes4(node.minX, node.minY, node.minZ, node.maxX, node.maxY, node.maxZ, ray, tMax, dist);
+#endif
+		for(int i = 0; i < 4; i++)
+		{
+			if(node.count[i] < 0)
+				mask &= ~(1 << i);
+		}
+		return mask;
+	}
+
+	// Creates the wide node for binary node nodeIdx and recurses into its interior children
+	int Collapse( const BVH& bvh, int binaryIdx, int nodeDepth )
+	{
+		depth = std::max(depth, nodeDepth);
+
+		// Open the interior child with the largest surface area until there are four children
+		int slots[4] = { bvh.nodes[binaryIdx].leftFirst, bvh.nodes[binaryIdx].leftFirst + 1, 0, 0 };
+		int n = 2;
+		while(n < 4)
+		{
+			int best = -1;
+			float bestArea = -1.0f;
+			for(int i = 0; i < n; i++)
+			{
+				const BVHNode& c = bvh.nodes[slots[i]];
+				if(c.count == 0 && c.bounds.SurfaceArea() > bestArea)
+				{
+					bestArea = c.bounds.SurfaceArea();
+					best = i;
+				}
+			}
+			if(best == -1)
+				break;
+
+			int opened = slots[best];
+			slots[best] = bvh.nodes[opened].leftFirst;
+			slots[n++] = bvh.nodes[opened].leftFirst + 1;
+		}
+
+		int wideIdx = nodes.size();
+		nodes.push_back(WideBVHNode());
+		sources.resize(nodes.size() * 4, -1);
+		Fill(bvh, wideIdx, slots, n, nodeDepth);
+		return wideIdx;
+	}
+
+	void Fill( const BVH& bvh, int wideIdx, const int* slots, int n, int nodeDepth )
+	{
+		for(int i = 0; i < 4; i++)
+		{
+			WideBVHNode& node = nodes[wideIdx];
+			if(i >= n)
+			{
+				node.minX[i] = node.minY[i] = node.minZ[i] = 0.0f;
+				node.maxX[i] = node.maxY[i] = node.maxZ[i] = 0.0f;
+				node.child[i] = 0;
+				node.count[i] = -1;
+				continue;
+			}
+
+			const BVHNode& c = bvh.nodes[slots[i]];
+			sources[wideIdx*4 + i] = slots[i];
+			node.minX[i] = c.bounds.min.x; node.minY[i] = c.bounds.min.y; node.minZ[i] = c.bounds.min.z;
+			node.maxX[i] = c.bounds.max.x; node.maxY[i] = c.bounds.max.y; node.maxZ[i] = c.bounds.max.z;
+
+			if(c.count > 0)
+			{
+				node.child[i] = c.leftFirst;
+				node.count[i] = c.count;
+			}
+			else
+			{
+				node.count[i] = 0;
+				// Collapse may reallocate nodes, so don't hold the reference across it
+				int child = Collapse(bvh, slots[i], nodeDepth + 1);
+				nodes[wideIdx].child[i] = child;
+			}
+		}
+	}
+};
+
+#endif
@@ -4,10 +4,44 @@
 // Feature Toggling - Can toggle render features and settings at runtime
 // Modular lighting system (2 to generate random light, 3 to delete newest light). Allows for multiple lights, properties defined in Light class in TestModel.h
 // Multithreading (4 to toggle, 5-6 to change number of threads) - Uses OpenMP to do calculations across multiple threads
+// Tile Pool - Per pixel passes are split into square tiles in Morton order and run on a persistent pool of threads that steal
+// tiles from each other once their own run out. Prints how busy each thread was every frame
 // Supersample Antialiasing (7 key) - An additional N^2 rays are fired per pixel and the resulting colour averaged to smoothen jagged edges
-// Soft Shadows (8 key) - A light is split into N lights with 1 / N intensity and a random position jitter added to simulate soft shadows
+// Adaptive Antialiasing (K key) - With AA on, every pixel gets one ray first and only pixels on an edge between surfaces, or with a
+// colour contrast against a neighbour, get the N^2 rays
+// Soft Shadows (8 key) - Lights are small square area lights sampled N times at stratified points, shifted per pixel by
+// blue noise so the remaining error is fine grain instead of banding
 // Depth of Field (9 to toggle, [ and ] to change focal length) - Distance vectors relative to focal length stored for each pixel, 
 // used to set neighbour weightings in blur kernel
+// Bounding Volume Hierarchy - Binned SAH BVH built over the triangles at load time on all threads, traversed by primary and shadow rays
+// Packed Triangles - Structure-of-arrays triangle store with precomputed edges, tested 8 (AVX) or 4 (SSE) triangles at a time
+// Ray Packets (P key) - Primary rays traced in 8x8 pixel blocks, culled against the block frustum
+// Wavefront Rendering (V key) - Primary rays of a whole wave of pixels are traced in bulk, then their shadow rays are binned by light and octahedral direction bucket and tested in bulk
+// Occluder Cache (O key) - Each thread remembers the triangle that last blocked each light sample and tests it before a full shadow ray
+// traversal, printing how often it answered the query every frame
+// Render Thread - Frames are drawn on their own thread, checking for cancellation between tiles, so the window keeps handling
+// events while they render. A key press abandons the frame in flight and it is started again with the new settings
+// Progressive Rendering (R key) - While nothing changes, every idle frame adds another jittered sample per pixel, with the soft
+// shadow pattern moved on, into an accumulation buffer until PROGRESSIVE_MAX_SAMPLES. Any change starts again from one sample
+// G-Buffer Reuse - The primary hit and normal of every sample are kept, so frames where only the lights changed skip the primary rays
+// Lightmaps (L key) - Direct light with the same (soft) shadow sampling is baked into texels on every scene triangle, so a frame
+// where only the camera moved costs primary rays and lookups. Baked again after the lights or the geometry change
+// Light Tree (I key, -lights N to add N random lights) - Lights are kept in a BVH and, once there are more than a few, each hit
+// fires a fixed number of shadow rays at lights picked in proportion to their estimated contribution
+// Counter-Based Random Numbers - Random values are hashes of a key and an index, so any thread gets the same numbers for the same
+// pixel, point or light, and renders are bit-identical for any number of threads
+// Hybrid Rendering (H key) - Primary visibility is rasterised into a buffer of triangle IDs and depths, then only the hits are
+// lit from it with shadow rays
+// Wide BVH (B key or -accel bvh4) - 4-wide BVH collapsed from the binary one, all four child boxes tested with one SSE slab test
+// Compressed BVH (B key or -accel qbvh4) - The wide BVH with child boxes quantised to 8 bits in 64 byte nodes
+// Kd-Tree (B key or -accel kdtree) - SAH kd-tree for static scenes with neighbour ropes on every leaf, so rays walk it without a stack
+// Uniform Grid (B key or -accel grid) - Cheap to build grid traversed with a 3D-DDA, rebuilt every frame while animating
+// Brute Force (B key or -accel brute) - Every ray tests every triangle, as a baseline for the benchmark
+// Instancing (-instances N) - Two-level BVH placing N copies of enemy1.stl that all share one mesh BVH
+// Animation (M key) - Triangles move every frame and the BVH is refit bottom up in parallel, then rebuilt once its SAH cost degrades too far
+// Scene Cache (-model file.stl, -nocache to skip) - Parsed meshes and their acceleration structures are cached next to the STL and mapped back in on later runs
+// Benchmark (-bench) - Times primary and shadow rays for every acceleration structure on the Cornell box and enemy1.stl (or the -model STL),
+// and soft shadows from several lights fired in pixel order, through the occluder cache and binned by light and direction
 
 /* ----------------------------------------------------------------------------*/
 
@@ -16,19 +50,71 @@
 #include <SDL.h>
 #include "SDLauxiliary.h"
 #include "TestModel.h"
+#include "TriangleStore.h"
+#include "RayPacket.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "CompressedBVH.h"
+#include "KdTree.h"
+#include "Grid.h"
+#include "Instancing.h"
+#include "SceneCache.h"
+#include "Lightmap.h"
+#include "VisibilityBuffer.h"
+#include "LightTree.h"
+#include "BlueNoise.h"
+#include "RenderThread.h"
+#include "TilePool.h"
+#include "Random.h"
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
 #include <limits>
 #include <omp.h>
+#include "../../rasteriser/Source/LoadSTL.cpp"
 
 using namespace std;
+using glm::vec2;
 using glm::vec3;
 using glm::mat3;
+using glm::mat4;
 
 /* ----------------------------------------------------------------------------*/
 /* GLOBAL VARIABLES                                                            */
 vector<Triangle> triangles;
+BVH bvh;
+WideBVH wideBVH;
+CompressedBVH compressedBVH;
+KdTree kdTree; // Keeps its own copy of the triangles, packed leaf by leaf. Only rebuilt while in use when animating
+Grid grid; // Keeps its own copy of the triangles, packed cell by cell
+TriangleStore triangleStore; // Packed in BVH leaf order. Rebuild whenever the triangles change
+Lightmap lightmap; // Direct light on the scene triangles. Invalidate whenever the lights or the geometry change
+VisibilityBuffer visibilityBuffer; // Triangle IDs and depths of the primary rays, rasterised each frame when hybrid rendering
+
+// enemy1.stl is kept with the rasteriser. The path is built from the executable's, which the
+// Makefile puts in raytracer/Build, so the model loads whatever the working directory is
+string ENEMY_MODEL_PATH;
+
+// Acceleration structure used for ray queries
+enum Accelerator { ACCEL_BVH2, ACCEL_BVH4, ACCEL_QBVH4, ACCEL_KDTREE, ACCEL_GRID, ACCEL_BRUTE, NUM_ACCELERATORS };
+const char* ACCELERATOR_NAMES[NUM_ACCELERATORS] = { "bvh2", "bvh4", "qbvh4", "kdtree", "grid", "brute" };
+Accelerator ACCELERATOR = ACCEL_BVH2;
+
+// Animated triangles are moved from their rest positions every frame
+vector<Triangle> restTriangles;
+int ANIMATED_FIRST = 10; // Triangles from this index on are animated. The Cornell box room is the first 10
+
+// Instanced meshes placed in the scene alongside the triangles above
+TwoLevelBVH instancedScene;
+int NUM_INSTANCES = 0;
 
 /* RENDER SETTINGS                                                             */
 //#define REALTIME
+//#define CUSTOM_MODEL
+
+// STL to render instead of the Cornell box. Set with -model, or to enemy1.stl by CUSTOM_MODEL
+const char* MODEL_PATH = 0;
+bool CACHE_ENABLED = true;
 
 bool MULTITHREADING_ENABLED = true;
 int NUM_THREADS; // Set by code
@@ -36,19 +122,48 @@ int SAVED_THREADS; // Stores thread value when changed
 
 bool AA_ENABLED = false;
 int AA_SAMPLES = 3;
+bool ADAPTIVE_AA_ENABLED = true;
+float ADAPTIVE_AA_CONTRAST = 0.1f; // Colour difference between neighbouring pixels that gets them supersampled
+
+bool PROGRESSIVE_ENABLED = false; // Antialiasing then comes from the accumulated samples, so AA_ENABLED is ignored
+int PROGRESSIVE_MAX_SAMPLES = 256;
 
 bool SOFT_SHADOWS_ENABLED = false;
-int SOFT_SHADOWS_SAMPLES = 16;
+int SOFT_SHADOWS_SAMPLES = 4;
 
 bool DOF_ENABLED = false;
 int DOF_KERNEL_SIZE = 8;
 float FOCAL_LENGTH = 1.3f;
 
-int NUM_LIGHTS = 0;
-Light lights[32];
+bool PACKETS_ENABLED = true;
+
+bool WAVEFRONT_ENABLED = false;
+const int WAVE_SHADOW_RAYS = 1 << 16; // Blocks per wave are chosen so a wave queues at most about this many shadow rays
+const int SHADOW_BUCKETS = 32; // Octahedral direction buckets per side used to bin shadow rays, a power of two
+const int SHADOW_KEY_BITS = 24; // Light index and direction bucket bits in a shadow ray sort key
+// Lights the sort key can tell apart. The 32x32 buckets take 10 bits, and the all ones key is left
+// to the shadow rays that are skipped
+const int MAX_LIGHTS = (1 << (SHADOW_KEY_BITS - 10)) - 1;
+
+bool OCCLUDER_CACHE_ENABLED = true;
+
+bool LIGHTMAP_ENABLED = false; // Not baked while animating, since the geometry changes every frame
+
+bool HYBRID_ENABLED = false;
+
+bool ANIMATION_ENABLED = false;
+float REBUILD_THRESHOLD = 1.3f; // Rebuild rather than refit once the BVH's SAH cost has grown by this factor
+
+vector<Light> lights;
+LightTree lightTree; // Over the lights and their soft shadow samples. Invalidate whenever the lights change
+bool LIGHT_TREE_ENABLED = true;
+int LIGHT_TREE_SAMPLES = 4; // Shadow rays per hit, picked from the tree once there are more lights than this
+int EXTRA_LIGHTS = 0;
 
 /* KEY STATES                                                                  */
 bool AA_key_pressed = false;
+bool adaptive_AA_key_pressed = false;
+bool progressive_key_pressed = false;
 bool shadows_key_pressed = false;
 bool DOF_key_pressed = false;
 bool OMP_key_pressed = false;
@@ -56,6 +171,14 @@ bool thread_add_key_pressed = false;
 bool thread_subtract_key_pressed = false;
 bool delete_light_key_pressed = false;
 bool add_light_key_pressed = false;
+bool packets_key_pressed = false;
+bool wavefront_key_pressed = false;
+bool occluder_cache_key_pressed = false;
+bool lightmap_key_pressed = false;
+bool hybrid_key_pressed = false;
+bool light_tree_key_pressed = false;
+bool accelerator_key_pressed = false;
+bool animation_key_pressed = false;
 
 // Use smaller parameters when camera moving for realtime performance
 #ifdef REALTIME
@@ -74,14 +197,21 @@ mat3 cameraRot = mat3(0.0f);
 float yaw = 0.0;
 
 SDL_Surface* screen;
-int t;
+int t; // When the frame in flight was started
 bool isUpdated = true;
 
+RenderThread renderThread;
+const int DISPLAY_INTERVAL = 16; // Milliseconds between checks of the window while a frame renders
+vector<Uint8> renderKeys; // Keys held when the frame in flight was started
+
+TilePool tilePool; // Runs the per pixel passes and the other loops of a frame, with NUM_THREADS threads
+const int TILE_SIZE = 16;
+
 // Ambient Lighting
 vec3 indirectLight = 0.2f*vec3(1,1,1);
 
-// Store jittered light positions for soft shadows. Needs minimum size of num lights * soft shadow samples.
-vec3 randomPositions[256];
+// Per pixel shifts of the soft shadow sample pattern, one tile for each coordinate
+BlueNoise blueNoise[2];
 
 // Depth of field data containers
 float focalDistances[SCREEN_WIDTH * SCREEN_HEIGHT];
@@ -93,27 +223,184 @@ struct Intersection
 	vec3 position;
 	float distance;
 	int triangleIndex;
+	int instanceIndex; // -1 for the scene triangles, otherwise triangleIndex is into the instance's mesh
+	float u, v;        // Barycentric coordinates of the hit on the triangle
 };
 
 vector<Intersection> closestIntersections;
 
+// Primary hit and unit normal of every sample of every pixel, kept from the last frame that
+// traced them. While only the lights change, frames are lit from here instead
+struct GBufferSample
+{
+	Intersection intersection; // triangleIndex is -1 where the ray missed
+	vec3 normal;
+};
+
+vector<GBufferSample> gBuffer;
+bool gBufferValid = false; // Cleared by anything that changes the primary rays or what they hit
+vector<unsigned char> edgePixels; // Pixels adaptive AA supersampled. The rest only have their first G-buffer sample
+
+// Sum of every sample progressive rendering has taken of each pixel since the view last changed
+vector<vec3> accumulation;
+int accumulatedSamples = 0;
+
+// Shadow ray towards one light sample, traced from the light so the surface can't block itself
+struct ShadowRay
+{
+	vec3 origin;
+	vec3 dir;
+	float tMax;
+	vec3 contribution; // Light reaching the point if nothing blocks the ray
+};
+
+// Triangle that last blocked shadow rays from one light sample
+struct Occluder
+{
+	int triangleIndex; // -1 if nothing has been cached yet
+	int instanceIndex;
+	bool blocked;      // Whether the last ray from this sample was blocked
+};
+
+// One per thread, each on its own cache lines. Neighbouring pixels are usually shadowed by the
+// same triangle, so the cached one is tested before traversing the acceleration structure
+struct alignas(64) OccluderCache
+{
+	vector<Occluder> last; // SOFT_SHADOWS_SAMPLES slots per light
+	long long queries;  // Shadow rays traced since the last reset
+	long long occluded; // How many of them were blocked
+	long long hits;     // How many were blocked by the cached triangle
+};
+
+vector<OccluderCache> occluderCaches;
+
+// Queues for wavefront rendering. Each stage runs over a whole queue before the next one starts
+struct PrimaryRay
+{
+	vec3 dir;
+	Hit hit;
+	Intersection intersection;
+	vec3 normal;     // Unit surface normal at the hit
+	vec3 color;      // Colour of the triangle that was hit
+	vec2 rotation;   // Shift of its soft shadow sample pattern
+	int shadowFirst; // First of its shadow rays in shadowQueue, or -1 if it missed
+	bool baked;      // Its direct light comes from the lightmap, so it has no shadow rays
+};
+
+vector<PrimaryRay> primaryQueue;   // Every sample of every pixel in the wave
+vector<ShadowRay> shadowQueue;     // Every light sample of every primary ray hit, in primary ray order
+vector<uint64_t> shadowOrder;      // Sort key in the high 32 bits, shadowQueue index in the low 32
+vector<uint64_t> shadowScratch;
+
 /* ----------------------------------------------------------------------------*/
 /* FUNCTIONS                                                                   */
 
 void Update();
+void StartRender(void (*job)());
+bool NewKeyPressed();
+void RenderFrame();
+void PresentFrame();
 void Draw();
+void DrawPrimary(int realSamples);
+void ResetAccumulation();
+void DrawProgressive();
+void DrawPixels(int realSamples);
+bool AdaptiveAAInUse(int realSamples);
+void SupersampleEdges(int realSamples);
+bool IsEdge(const GBufferSample& a, const GBufferSample& b, vec3 colorA, vec3 colorB);
+void DrawPackets(int realSamples);
+void DrawWavefront(int realSamples);
+void DrawLighting(int realSamples);
+void DrawHybrid(int realSamples);
+void TracePacket(RayPacket& packet);
+uint32_t ShadowKey(int light, vec3 dir);
+void RadixSort(vector<uint64_t>& values, vector<uint64_t>& scratch, int firstBit, int bits);
+void LoadModel(const char* path);
+void BuildAccelerators();
+void UpdateAccelerators();
+void AnimateTriangles(float time);
+void RunBenchmark();
+void BenchmarkShadowBins(const vector<vec3>& points);
 bool ClosestIntersection(vec3 start, vec3 dir, const vector<Triangle>& triangles,
 						 Intersection& closestIntersection, bool isLight, int x, int y);
-vec3 DirectLight(const Intersection& i);
-float RandomNumber();
+bool TraceClosest(vec3 start, vec3 dir, Hit& hit);
+void FillIntersection(vec3 start, const Hit& hit, Intersection& intersection);
+const Triangle& HitTriangle(const Intersection& i);
+vec3 SurfaceNormal(const Intersection& i);
+void AddInstances(int count);
+vec3 Shade(const Intersection& i, vec3 normal, vec2 rotation);
+bool Occluded(vec3 start, vec3 dir, float tMin, float tMax, Hit* blocker = 0);
+bool CachedOccluded(const ShadowRay& ray, int slot);
+void ResetOccluderCaches();
+void PrintOccluderCacheStats();
+void PrintTilePoolStats();
+int ThreadIndex();
+ShadowRay LightSample(vec3 point, vec3 normal, int light, int sample, int samples, vec2 rotation);
+vec2 SoftShadowSample(int sample, int samples, vec2 rotation);
+vec2 SampleRotation(int x, int y, int sample);
+bool LightTreeInUse();
+void BuildLightTree();
+ShadowRay TreeLightSample(vec3 point, vec3 normal, int j, int& slot, vec2 rotation);
+vec3 Irradiance(vec3 position, vec3 normal, vec2 rotation);
+vec3 DirectLight(const Intersection& i, vec3 normal, vec2 rotation);
+bool LightmapInUse();
+void BakeLightmap();
+float RandomNumber(Random& random);
 void CalculateDOF();
 void AddLight(vec3 position, vec3 color, float intensity);
 void DeleteLight();
+void AddRandomLight();
 
 int main( int argc, char* argv[] )
 {
+	string executable = argv[0];
+	size_t slash = executable.find_last_of("/\\");
+	ENEMY_MODEL_PATH = executable.substr(0, slash == string::npos ? 0 : slash + 1) + "../../rasteriser/Source/enemy1.stl";
+#ifdef CUSTOM_MODEL
+	MODEL_PATH = ENEMY_MODEL_PATH.c_str();
+#endif
+
+	bool benchmark = false;
+	for(int a = 1; a < argc; a++)
+	{
+		if(strcmp(argv[a], "-bench") == 0)
+			benchmark = true;
+		else if(strcmp(argv[a], "-model") == 0 && a + 1 < argc)
+			MODEL_PATH = argv[++a];
+		else if(strcmp(argv[a], "-nocache") == 0)
+			CACHE_ENABLED = false;
+		else if(strcmp(argv[a], "-instances") == 0 && a + 1 < argc)
+			NUM_INSTANCES = atoi(argv[++a]);
+		else if(strcmp(argv[a], "-lights") == 0 && a + 1 < argc)
+			EXTRA_LIGHTS = min(atoi(argv[++a]), MAX_LIGHTS - 1); // Added to the first light
+		else if(strcmp(argv[a], "-accel") == 0 && a + 1 < argc)
+		{
+			a++;
+			for(int i = 0; i < NUM_ACCELERATORS; i++)
+			{
+				if(strcmp(argv[a], ACCELERATOR_NAMES[i]) == 0)
+					ACCELERATOR = (Accelerator) i;
+			}
+		}
+	}
+
+	double noiseStart = omp_get_wtime();
+	blueNoise[0].Generate(1);
+	blueNoise[1].Generate(2);
+	cout << "Blue noise generated in " << (omp_get_wtime() - noiseStart) * 1000.0 << " ms" << endl;
+
+	if(benchmark)
+	{
+		RunBenchmark();
+		return 0;
+	}
+
 	screen = InitializeSDL( SCREEN_WIDTH, SCREEN_HEIGHT );
 	AddLight(vec3(0, -0.5f, -0.7f), vec3(1,1,1), 14 );
+	for(int i = 0; i < EXTRA_LIGHTS; i++)
+		AddRandomLight();
+	if(EXTRA_LIGHTS > 0)
+		cout << "Added " << EXTRA_LIGHTS << " random lights" << endl;
 
 	// Request as many threads as the system can provide
 	NUM_THREADS = omp_get_max_threads();
@@ -141,12 +428,25 @@ int main( int argc, char* argv[] )
 		cout << "Soft Shadows enabled with samples: " << SOFT_SHADOWS_SAMPLES << endl;
 	if(DOF_ENABLED)
 		cout << "DoF enabled with kernel size: " << DOF_KERNEL_SIZE << endl;
+	if(PACKETS_ENABLED)
+		cout << "Ray packets enabled with block size: " << RayPacket::BLOCK_SIZE << endl;
 
-	// Set start value for timer
-	t = SDL_GetTicks();
+	if(MODEL_PATH)
+	{
+		LoadModel(MODEL_PATH);
+		cameraPos = vec3(0,-0.5,-5.0f);
+		ANIMATED_FIRST = 0;
+	}
+	else
+	{
+		// Generate the Cornell Box
+		LoadTestModel( triangles );
+		BuildAccelerators();
+	}
 
-	// Generate the Cornell Box
-	LoadTestModel( triangles );
+	restTriangles = triangles;
+	AddInstances(NUM_INSTANCES);
+	cout << "Using " << ACCELERATOR_NAMES[ACCELERATOR] << " for ray queries" << endl;
 
 	// Every pixel will have a closest intersection
 	size_t i;
@@ -162,286 +462,1026 @@ int main( int argc, char* argv[] )
 	cameraRot[1][1] = 1.0f;
 
 
+	// The scene and settings only change in Update, which runs while the render thread is idle
+	bool frameInFlight = false;
 	while( NoQuitMessageSDL() )
 	{
+		if(frameInFlight)
+		{
+			if(NewKeyPressed())
+				renderThread.Cancel();
+			if(!renderThread.WaitFor(DISPLAY_INTERVAL))
+				continue;
+
+			// An abandoned frame is drawn again from scratch, whether or not the key changed anything
+			frameInFlight = false;
+			if(renderThread.Cancelled())
+				isUpdated = true;
+			else
+				PresentFrame();
+		}
+
 		Update();
 		if (isUpdated)
 		{
-			Draw();
+			StartRender(RenderFrame);
+			frameInFlight = true;
 			isUpdated = false;
 		}
+		else if(PROGRESSIVE_ENABLED && accumulatedSamples < PROGRESSIVE_MAX_SAMPLES)
+		{
+			StartRender(DrawProgressive);
+			frameInFlight = true;
+		}
+		else
+			SDL_Delay(DISPLAY_INTERVAL);
 	}
+	renderThread.Stop();
 
 	SDL_SaveBMP( screen, "screenshot.bmp" );
 
 	return 0;
 }
 
-void AddLight(vec3 position, vec3 color, float intensity)
+// Loads an STL and its acceleration structures from the scene cache. Without a usable cache
+// the STL is parsed and built as usual and the cache is written for next time
+void LoadModel(const char* path)
 {
-	lights[NUM_LIGHTS].position = position;
-	lights[NUM_LIGHTS].color = color;
-	lights[NUM_LIGHTS].intensity = intensity;
-
-	for(int i = 0; i < SOFT_SHADOWS_SAMPLES; i++)
+	double start = omp_get_wtime();
+	lightmap.Invalidate();
+	gBufferValid = false;
+	if(CACHE_ENABLED && SceneCache::Load(path, triangles, bvh, wideBVH, compressedBVH, kdTree, triangleStore))
 	{
-		vec3 randomPos(lights[NUM_LIGHTS].position.x + (RandomNumber() * 0.08f), lights[NUM_LIGHTS].position.y + (RandomNumber() * 0.08f), lights[NUM_LIGHTS].position.z + (RandomNumber() * 0.08f));
-		randomPositions[(NUM_LIGHTS*SOFT_SHADOWS_SAMPLES) + i] = randomPos;
+		cout << "Loaded " << triangles.size() << " triangles and acceleration structures from " << SceneCache::CachePath(path)
+			 << " in " << (omp_get_wtime() - start) * 1000.0 << " ms" << endl;
+
+		// The grid is cheap enough to build on every load instead of caching it
+		grid.Build(triangles);
+		return;
 	}
 
-	NUM_LIGHTS++;
+	LoadSTL customModel;
+	customModel.LoadSTLFile(triangles, path);
+	cout << "Parsed " << triangles.size() << " triangles from " << path << " in " << (omp_get_wtime() - start) * 1000.0 << " ms" << endl;
+	BuildAccelerators();
+
+	if(CACHE_ENABLED)
+	{
+		if(SceneCache::Save(path, triangles, bvh, wideBVH, compressedBVH, kdTree, triangleStore))
+			cout << "Wrote scene cache " << SceneCache::CachePath(path) << endl;
+		else
+			cout << "Could not write scene cache " << SceneCache::CachePath(path) << endl;
+	}
 }
 
-void DeleteLight()
+// Builds every acceleration structure over the current triangles
+void BuildAccelerators()
 {
-	if(NUM_LIGHTS > 0)
-		NUM_LIGHTS--;
+	double start = omp_get_wtime();
+	lightmap.Invalidate();
+	gBufferValid = false;
+	bvh.Build(triangles);
+	triangleStore.Build(triangles, bvh.triIndices);
+	double bvhTime = omp_get_wtime() - start;
+
+	start = omp_get_wtime();
+	wideBVH.Build(bvh);
+	double wideTime = omp_get_wtime() - start;
+
+	start = omp_get_wtime();
+	if(!compressedBVH.Build(wideBVH))
+		cout << "BVH has a leaf too big for the compressed nodes, qbvh4 is unavailable" << endl;
+	double compressedTime = omp_get_wtime() - start;
+
+	start = omp_get_wtime();
+	kdTree.Build(triangles);
+	double kdTime = omp_get_wtime() - start;
+
+	start = omp_get_wtime();
+	grid.Build(triangles);
+	double gridTime = omp_get_wtime() - start;
+
+	float perTriangle = 1.0f / max((size_t)1, triangles.size());
+
+	cout << "Triangle kernel tests " << SIMD_WIDTH << " triangles at a time" << endl;
+	cout << "BVH built over " << triangles.size() << " triangles with " << bvh.nodes.size() << " nodes, depth " << bvh.depth
+		 << " in " << bvhTime * 1000.0 << " ms (" << triangles.size() / bvhTime / 1e6 << " Mtris/s on " << omp_get_max_threads()
+		 << " threads, " << bvh.nodes.size() * sizeof(BVHNode) / 1024 << " KB, " << bvh.nodes.size() * sizeof(BVHNode) * perTriangle << " B/tri)" << endl;
+	cout << "BVH4 collapsed to " << wideBVH.nodes.size() << " nodes, depth " << wideBVH.depth
+		 << " in " << wideTime * 1000.0 << " ms (" << wideBVH.nodes.size() * sizeof(WideBVHNode) / 1024 << " KB, "
+		 << wideBVH.nodes.size() * sizeof(WideBVHNode) * perTriangle << " B/tri)" << endl;
+	cout << "QBVH4 compressed to " << sizeof(CompressedBVHNode) << " byte nodes in " << compressedTime * 1000.0 << " ms ("
+		 << compressedBVH.nodes.size() * sizeof(CompressedBVHNode) / 1024 << " KB, " << compressedBVH.nodes.size() * sizeof(CompressedBVHNode) * perTriangle << " B/tri)" << endl;
+	cout << "Kd-tree built with " << kdTree.nodes.size() << " nodes, " << kdTree.leaves.size() << " leaves, depth " << kdTree.depth << " and "
+		 << kdTree.References() << " triangle references in " << kdTime * 1000.0 << " ms (" << triangles.size() / kdTime / 1e6 << " Mtris/s, "
+		 << kdTree.MemoryUsage() / 1024 << " KB, " << kdTree.MemoryUsage() * perTriangle << " B/tri)" << endl;
+	cout << "Grid of " << grid.res.x << "x" << grid.res.y << "x" << grid.res.z << " cells with " << grid.References() << " triangle references built in "
+		 << gridTime * 1000.0 << " ms (" << triangles.size() / gridTime / 1e6 << " Mtris/s)" << endl;
 }
 
-
-bool ClosestIntersection(vec3 start, vec3 dir, const vector<Triangle>& triangles,
-						 Intersection& closestIntersection, bool isLight, int x, int y)
+// Brings the acceleration structures up to date after the triangles moved. The BVH is refit
+// until its SAH cost has grown by REBUILD_THRESHOLD since it was built, then rebuilt
+void UpdateAccelerators()
 {
-	bool intersection = false;
-	// check all triangles for intersections
+	double start = omp_get_wtime();
+	lightmap.Invalidate();
+	gBufferValid = false;
+	grid.Build(triangles);
+	double gridTime = omp_get_wtime() - start;
+
+	// The kd-tree can't be refit, so it is only rebuilt while it is the one being traced
+	if(ACCELERATOR == ACCEL_KDTREE)
+		kdTree.Build(triangles);
+	else
+		kdTree.Clear();
 
-	for (size_t i = 0; i < triangles.size(); i++)
+	start = omp_get_wtime();
+	bvh.Refit(triangles);
+	float degradation = bvh.SAHCost() / bvh.buildCost;
+	if(degradation > REBUILD_THRESHOLD)
 	{
-		// the 3D real vectors that define the triangle
-		vec3 v0 = triangles[i].v0;
-		vec3 v1 = triangles[i].v1;
-		vec3 v2 = triangles[i].v2;
+		cout << "BVH SAH cost grew to " << degradation << "x its build cost, rebuilding" << endl;
+		BuildAccelerators();
+		return;
+	}
 
-		// edges that are co-planar
-		vec3 e1 = v1 - v0;
-		vec3 e2 = v2 - v0;
-		vec3 b = start - v0;
+	triangleStore.Update(triangles);
+	wideBVH.Refit(bvh);
+	compressedBVH.Build(wideBVH);
+	cout << "Refit " << triangles.size() << " triangles in " << (omp_get_wtime() - start) * 1000.0
+		 << " ms (SAH cost " << degradation << "x build), grid rebuilt in " << gridTime * 1000.0 << " ms" << endl;
+}
 
-		// keep this for speed comparison
-		//mat3 A(-dir, e1, e2);vec3 x = glm::inverse(A) * b; float t = x.x, u = x.y, v = x.z;
+// Turns the animated triangles about the vertical axis through their rest centre
+void AnimateTriangles(float time)
+{
+	vec3 centre(0.0f, 0.0f, 0.0f);
+	for(size_t i = ANIMATED_FIRST; i < restTriangles.size(); i++)
+		centre += restTriangles[i].v0 + restTriangles[i].v1 + restTriangles[i].v2;
+	centre /= (float) max((size_t)1, 3 * (restTriangles.size() - ANIMATED_FIRST));
+
+	mat3 rotation(1.0f);
+	rotation[0][0] = cos(time * 0.5f);
+	rotation[0][2] = sin(time * 0.5f);
+	rotation[2][0] = -sin(time * 0.5f);
+	rotation[2][2] = cos(time * 0.5f);
+
+	tilePool.For(restTriangles.size() - ANIMATED_FIRST, 1024, [&]( int begin, int end )
+	{
+		for(int i = ANIMATED_FIRST + begin; i < ANIMATED_FIRST + end; i++)
+		{
+			const Triangle& rest = restTriangles[i];
+			triangles[i].v0 = centre + rotation * (rest.v0 - centre);
+			triangles[i].v1 = centre + rotation * (rest.v1 - centre);
+			triangles[i].v2 = centre + rotation * (rest.v2 - centre);
+			triangles[i].ComputeNormal();
+		}
+	});
+}
 
-		// Cramer's rule: valid when there is a solution
-		//anticommutative
-		vec3 e1e2 = glm::cross(e1,e2);
-		vec3 be2 = glm::cross(b,e2);
-		vec3 e1b = glm::cross(e1,b);
+// Traces one frame of primary rays and one shadow ray per hit with every acceleration structure,
+// on the Cornell box and on enemy1.stl, and prints the ray throughput
+void RunBenchmark()
+{
+	const int RUNS = 3;
+	vec3 lightPos(0, -0.5f, -0.7f);
+	vector<Intersection> hits(SCREEN_WIDTH*SCREEN_HEIGHT);
+	cameraRot = mat3(1.0f);
+	tilePool.Resize(omp_get_max_threads()); // Sorts the binned shadow rays
+	AddInstances(NUM_INSTANCES);
+
+	for(int scene = 0; scene < 2; scene++)
+	{
+		if(scene == 0)
+		{
+			cout << "Cornell box" << endl;
+			LoadTestModel( triangles );
+			BuildAccelerators();
+			cameraPos = vec3(0.0f, 0.0f, -2.0f);
+		}
+		else
+		{
+			const char* path = MODEL_PATH ? MODEL_PATH : ENEMY_MODEL_PATH.c_str();
+			cout << path << endl;
+			LoadModel(path);
+			cameraPos = vec3(0,-0.5,-2.5f);
+		}
 
-		vec3 negD = -dir;
+		for(int a = 0; a < NUM_ACCELERATORS; a++)
+		{
+			ACCELERATOR = (Accelerator) a;
+			int hitCount = 0;
+			int shadowed = 0;
 
-		float e1e2b = e1e2.x*b.x+e1e2.y*b.y+e1e2.z*b.z;
-		float e1e2d = e1e2.x*negD.x+e1e2.y*negD.y+e1e2.z*negD.z;
-		float be2d =  be2.x*negD.x+be2.y*negD.y+be2.z*negD.z;
-		float e1bd =  e1b.x*negD.x+e1b.y*negD.y+e1b.z*negD.z;
+			double start = omp_get_wtime();
+			for(int run = 0; run < RUNS; run++)
+			{
+				hitCount = 0;
+				#pragma omp parallel for schedule(dynamic) reduction(+:hitCount)
+				for (int y = 0; y < SCREEN_HEIGHT; y++)
+				{
+					for (int x = 0; x < SCREEN_WIDTH; x++)
+					{
+						Intersection& i = hits[y*SCREEN_HEIGHT + x];
+						i.distance = std::numeric_limits<float>::max();
+						i.triangleIndex = -1;
+						i.instanceIndex = -1;
+						vec3 d(x-(float)SCREEN_WIDTH/2.0f, y - (float)SCREEN_HEIGHT/2.0f, focalLength);
+						if(ClosestIntersection(cameraPos, cameraRot*d, triangles, i, true, x, y))
+							hitCount++;
+					}
+				}
+			}
+			double primaryTime = (omp_get_wtime() - start) / RUNS;
 
-		// checking constraints for point to be in triangle
-		float t = e1e2b/e1e2d, u = be2d/e1e2d, v = e1bd/e1e2d;
+			vector<vec3> points;
+			for (int p = 0; p < SCREEN_WIDTH*SCREEN_HEIGHT; p++)
+			{
+				if(hits[p].triangleIndex >= 0)
+					points.push_back(hits[p].position);
+			}
 
-		if (u+v <= 1.0f && u >= 0.0f && v >= 0.0f && t >= 0.0f)
-		{
-			vec3 pos = v0 + (u*e1) + (v*e2);
-			float distance = glm::distance(start, pos);
-			if (closestIntersection.distance >= distance)
+			start = omp_get_wtime();
+			for(int run = 0; run < RUNS; run++)
 			{
-					closestIntersection.position = pos;
-					closestIntersection.distance = distance;
-					closestIntersection.triangleIndex = i;
-					if(!isLight) 
-						focalDistances[y*SCREEN_HEIGHT + x] = distance - FOCAL_LENGTH;
+				shadowed = 0;
+				#pragma omp parallel for schedule(dynamic, 256) reduction(+:shadowed)
+				for (int p = 0; p < (int)points.size(); p++)
+				{
+					float r = glm::distance(points[p], lightPos);
+					if(Occluded(lightPos, glm::normalize(points[p] - lightPos), 0.0f, r*0.99f))
+						shadowed++;
+				}
 			}
-			intersection = true;
-		}
-	}
+			double shadowTime = (omp_get_wtime() - start) / RUNS;
 
+			cout << "  " << ACCELERATOR_NAMES[a] << ": primary " << primaryTime * 1000.0 << " ms ("
+				 << SCREEN_WIDTH*SCREEN_HEIGHT / primaryTime / 1e6 << " Mrays/s, " << hitCount << " hits), shadow "
+				 << shadowTime * 1000.0 << " ms (" << hitCount / shadowTime / 1e6 << " Mrays/s, " << shadowed << " occluded)" << endl;
+		}
 
-	return intersection;
-}
+		vector<vec3> points;
+		for (int p = 0; p < SCREEN_WIDTH*SCREEN_HEIGHT; p++)
+		{
+			if(hits[p].triangleIndex >= 0)
+				points.push_back(hits[p].position);
+		}
+		BenchmarkShadowBins(points);
 
-// Returns a random number between -0.5 and 0.5
-float RandomNumber()
-{
-	return ((double) rand() / (RAND_MAX)) - 0.5f;
+		// One frame of animation
+		restTriangles = triangles;
+		ANIMATED_FIRST = (scene == 0) ? 10 : 0;
+		AnimateTriangles(0.1f);
+		UpdateAccelerators();
+	}
 }
 
-vec3 DirectLight(const Intersection& i)
+// Soft shadows from several lights to the hit points, fired in the order DirectLight fires them
+// (every light sample of a point before the next point), then again through the occluder caches
+// and then binned by light and direction as DrawWavefront does, with the binning counted in the
+// binned time
+void BenchmarkShadowBins(const vector<vec3>& points)
 {
-	int counter;
-	int samples;
-	vec3 result(0.0f,0.0f,0.0f);
-	vec3 result2(0,0,0);
-
-	if(SOFT_SHADOWS_ENABLED)
-		samples = SOFT_SHADOWS_SAMPLES;
-	else
-		samples = 1;
-
-	for(int k = 0; k < NUM_LIGHTS; k++)
+	const int RUNS = 3;
+	const int LIGHTS = 4;
+	const int MAX_POINTS = 16384;
+	const int SAMPLES = 16; // Fixed, so runs compare whatever the soft shadow setting is
+	if(points.empty())
+		return;
+
+	// The occluder caches keep SOFT_SHADOWS_SAMPLES slots per light, so it matches SAMPLES while this runs
+	int softShadowsSamples = SOFT_SHADOWS_SAMPLES;
+	SOFT_SHADOWS_SAMPLES = SAMPLES;
+
+	lights.clear();
+	for(int k = 0; k < LIGHTS; k++)
+		AddLight(vec3(-0.6f + 0.4f*k, -0.5f, -0.7f + 0.3f*(k % 2)), vec3(1,1,1), 14);
+
+	// Every light sample of an evenly spread subset of the points, in pixel order
+	int stride = max(1, (int) points.size() / MAX_POINTS);
+	vector<ShadowRay> rays;
+	for(size_t p = 0; p < points.size(); p += stride)
 	{
-		for(counter = 0; counter < samples; counter++)
+		for(int k = 0; k < LIGHTS; k++)
 		{
-			vec3 position;
-			vec3 lightColor = lights[k].color * lights[k].intensity;
-
-			if(samples != 1)
+			for(int s = 0; s < SAMPLES; s++)
 			{
-				position = randomPositions[(k*SOFT_SHADOWS_SAMPLES) + counter];
+				ShadowRay ray;
+				ray.origin = lights[k].SamplePosition(SoftShadowSample(s, SAMPLES, vec2(0.0f)));
+				ray.dir = glm::normalize(points[p] - ray.origin);
+				ray.tMax = glm::distance(points[p], ray.origin)*0.99f;
+				rays.push_back(ray);
 			}
-			else
+		}
+	}
+	int count = rays.size();
+
+	vector<uint64_t> order(count), scratch;
+	for(int i = 0; i < count; i++)
+		order[i] = ((uint64_t) ShadowKey((i / SAMPLES) % LIGHTS, rays[i].dir) << 32) | i;
+	RadixSort(order, scratch, 32, SHADOW_KEY_BITS);
+	int bins = 0;
+	for(int i = 0; i < count; i++)
+	{
+		if(i == 0 || (order[i] >> 32) != (order[i - 1] >> 32))
+			bins++;
+	}
+	cout << "  Soft shadows from " << LIGHTS << " lights x " << SAMPLES << " samples: " << count << " rays in "
+		 << bins << " bins (" << (float) count / bins << " rays per bin)" << endl;
+
+	for(int a = 0; a < NUM_ACCELERATORS; a++)
+	{
+		if(a == ACCEL_BRUTE)
+			continue;
+		ACCELERATOR = (Accelerator) a;
+
+		int pixelOccluded = 0;
+		double start = omp_get_wtime();
+		for(int run = 0; run < RUNS; run++)
+		{
+			pixelOccluded = 0;
+			#pragma omp parallel for schedule(dynamic, 256) reduction(+:pixelOccluded)
+			for(int i = 0; i < count; i++)
 			{
-				position = lights[k].position;
+				if(Occluded(rays[i].origin, rays[i].dir, 0.0f, rays[i].tMax))
+					pixelOccluded++;
 			}
+		}
+		double pixelTime = (omp_get_wtime() - start) / RUNS;
 
-			// r is distance from lightPos and intersection pos
-			float r = glm::distance(i.position, position);
-			float A = 4*M_PI*(r*r);
-			vec3 P = lightColor /= (float) samples;
-			// unit vector of direction from surface to light
-			vec3 rDir = glm::normalize(position - i.position);
-			// unit vector describing normal of surface
-			vec3 nDir = glm::normalize(triangles[i.triangleIndex].normal);
-			vec3 B = P/A;
-
-			// direct light intensity
-			vec3 D = B * max(glm::dot(rDir,nDir), 0.0f);
-
-			// direct shadows
-			Intersection j;
-			j.distance = std::numeric_limits<float>::max();
-			// to avoid comparing with self, trace from light and reverse direction
-			if (ClosestIntersection(position, -rDir, triangles, j, true, 0, 0))
+		int cachedOccluded = 0;
+		start = omp_get_wtime();
+		for(int run = 0; run < RUNS; run++)
+		{
+			ResetOccluderCaches();
+			cachedOccluded = 0;
+			#pragma omp parallel for schedule(dynamic, 256) reduction(+:cachedOccluded)
+			for(int i = 0; i < count; i++)
 			{
-				// if intersection is closer to light source than self
-				if (j.distance < r*0.99f) // small multiplier to reduce noise
-					D = vec3 (0.0f, 0.0f, 0.0f);
+				if(CachedOccluded(rays[i], ((i / SAMPLES) % LIGHTS)*SAMPLES + i % SAMPLES))
+					cachedOccluded++;
+			}
+		}
+		double cachedTime = (omp_get_wtime() - start) / RUNS;
+		long long cacheHits = 0;
+		for(size_t c = 0; c < occluderCaches.size(); c++)
+			cacheHits += occluderCaches[c].hits;
+
+		int binnedOccluded = 0;
+		double binTime = 0.0;
+		start = omp_get_wtime();
+		for(int run = 0; run < RUNS; run++)
+		{
+			double binStart = omp_get_wtime();
+			#pragma omp parallel for schedule(static)
+			for(int i = 0; i < count; i++)
+				order[i] = ((uint64_t) ShadowKey((i / SAMPLES) % LIGHTS, rays[i].dir) << 32) | i;
+			RadixSort(order, scratch, 32, SHADOW_KEY_BITS);
+			binTime += omp_get_wtime() - binStart;
+
+			binnedOccluded = 0;
+			#pragma omp parallel for schedule(dynamic, 256) reduction(+:binnedOccluded)
+			for(int o = 0; o < count; o++)
+			{
+				const ShadowRay& ray = rays[order[o] & 0xffffffffull];
+				if(Occluded(ray.origin, ray.dir, 0.0f, ray.tMax))
+					binnedOccluded++;
 			}
-
-			// diffuse
-			// the color stored in the triangle is the reflected fraction of light
-			result += D;
 		}
-		//result /= (float) samples;
-		result2 += result;
+		double binnedTime = (omp_get_wtime() - start) / RUNS;
+
+		cout << "  " << ACCELERATOR_NAMES[a] << " soft shadows: pixel order " << pixelTime * 1000.0 << " ms (" << count / pixelTime / 1e6
+			 << " Mrays/s, " << pixelOccluded << " occluded), occluder cache " << cachedTime * 1000.0 << " ms (" << count / cachedTime / 1e6
+			 << " Mrays/s, " << cachedOccluded << " occluded, " << 100.0 * cacheHits / max(cachedOccluded, 1) << "% of them cache hits), binned " << binnedTime * 1000.0 << " ms (" << count / binnedTime / 1e6
+			 << " Mrays/s, " << binnedOccluded << " occluded, " << binTime / RUNS * 1000.0 << " ms to bin)" << endl;
 	}
 
-	vec3 p = triangles[i.triangleIndex].color;
-	return result2*p;
+	lights.clear();
+	SOFT_SHADOWS_SAMPLES = softShadowsSamples;
 }
 
-void Update()
+void AddLight(vec3 position, vec3 color, float intensity)
 {
-	// Compute frame time
-	int t2 = SDL_GetTicks();
+	if(lights.size() >= (size_t) MAX_LIGHTS)
+	{
+		cout << "Can't add more than " << MAX_LIGHTS << " lights" << endl;
+		return;
+	}
 
-	// Reset intersection distances
-	float m = std::numeric_limits<float>::max();
-	for(int i = 0; i < SCREEN_WIDTH*SCREEN_HEIGHT; i++)
+	lights.push_back(Light(position, color, intensity));
+	lightmap.Invalidate();
+	lightTree.Invalidate();
+}
+
+void DeleteLight()
+{
+	if(!lights.empty())
+		lights.pop_back();
+	lightmap.Invalidate();
+	lightTree.Invalidate();
+}
+
+// Light of a random colour and intensity somewhere in the Cornell box
+void AddRandomLight()
+{
+	// Keyed on the light's index, so -lights N adds the same lights on every run
+	Random random(lights.size());
+	vec3 position(RandomNumber(random) * 2.0f, RandomNumber(random) * 2.0f, RandomNumber(random) * 2.0f);
+	vec3 color(abs(RandomNumber(random)) * 2.0f + 0.2f, abs(RandomNumber(random)) * 2.0f + 0.2f, abs(RandomNumber(random)) * 2.0f + 0.2f);
+	AddLight(position, color, abs(RandomNumber(random)) * 20.0f);
+}
+
+// Rebuilds the light tree over the box around each light
+void BuildLightTree()
+{
+	vector<AABB> boxes(lights.size());
+	vector<float> power(lights.size());
+	for(size_t k = 0; k < lights.size(); k++)
 	{
-		closestIntersections[i].distance = m;
+		boxes[k].Grow(lights[k].SamplePosition(vec2(0.0f)));
+		boxes[k].Grow(lights[k].SamplePosition(vec2(1.0f)));
+		power[k] = (lights[k].color.x + lights[k].color.y + lights[k].color.z) * lights[k].intensity;
 	}
+	lightTree.Build(boxes, power);
+}
 
-	float dt = float(t2-t);
-	t = t2;
-	cout << "Render time: " << dt << " ms." << endl;
 
-	// Adjust camera transform
-	vec3 right(cameraRot[0][0], cameraRot[0][1], cameraRot[0][2]);
-	vec3 down(cameraRot[1][0], cameraRot[1][1], cameraRot[1][2]);
-	vec3 forward(cameraRot[2][0], cameraRot[2][1], cameraRot[2][2]);
-	Uint8* keystate = SDL_GetKeyState( 0 );
-	
-	if( keystate[SDLK_UP] )
+bool ClosestIntersection(vec3 start, vec3 dir, const vector<Triangle>& triangles,
+						 Intersection& closestIntersection, bool isLight, int x, int y)
+{
+	// Only accept hits closer than the current closest intersection. The BVH works in
+	// multiples of dir, so convert the stored distance
+	Hit hit;
+	hit.t = closestIntersection.distance / glm::length(dir);
+	hit.instanceIndex = -1;
+	if (!TraceClosest(start, dir, hit))
+		return false;
+
+	FillIntersection(start, hit, closestIntersection);
+	if(!isLight) 
+		focalDistances[y*SCREEN_HEIGHT + x] = closestIntersection.distance - FOCAL_LENGTH;
+
+	return true;
+}
+
+// Closest hit query against the selected acceleration structure and the instances. Only hits
+// with t < hit.t are accepted
+bool TraceClosest(vec3 start, vec3 dir, Hit& hit)
+{
+	bool found = false;
+	switch(ACCELERATOR)
 	{
-		// Move camera forward
-		cameraPos += 0.1f*forward;
-		isUpdated = true;
+		case ACCEL_BVH2: found = bvh.Intersect(triangleStore, start, dir, hit); break;
+		case ACCEL_BVH4: found = wideBVH.Intersect(triangleStore, start, dir, hit); break;
+		case ACCEL_QBVH4: found = compressedBVH.Intersect(triangleStore, start, dir, hit); break;
+		case ACCEL_KDTREE: found = kdTree.Intersect(start, dir, hit); break;
+		case ACCEL_GRID: found = grid.Intersect(start, dir, hit); break;
+		case ACCEL_BRUTE: found = triangleStore.IntersectRange(0, triangleStore.count, start, dir, hit); break;
 	}
-	else if( keystate[SDLK_DOWN] )
+	if (instancedScene.Intersect(start, dir, hit))
+		found = true;
+	return found;
+}
+
+// Converts a ray query hit into the intersection point on the scene triangle
+void FillIntersection(vec3 start, const Hit& hit, Intersection& intersection)
+{
+	intersection.triangleIndex = hit.triangleIndex;
+	intersection.instanceIndex = hit.instanceIndex;
+	intersection.u = hit.u;
+	intersection.v = hit.v;
+
+	const Triangle& triangle = HitTriangle(intersection);
+	vec3 pos = triangle.v0 + (hit.u*(triangle.v1 - triangle.v0)) + (hit.v*(triangle.v2 - triangle.v0));
+
+	// Instance hits are found in object space
+	if(hit.instanceIndex >= 0)
+		pos = vec3(instancedScene.instances[hit.instanceIndex].transform * glm::vec4(pos, 1.0f));
+
+	intersection.position = pos;
+	intersection.distance = glm::distance(start, pos);
+}
+
+// The triangle that was hit, from the scene triangles or from the instance's mesh
+const Triangle& HitTriangle(const Intersection& i)
+{
+	if(i.instanceIndex < 0)
+		return triangles[i.triangleIndex];
+	const Instance& instance = instancedScene.instances[i.instanceIndex];
+	return instancedScene.meshes[instance.mesh].triangles[i.triangleIndex];
+}
+
+// World space normal of the triangle that was hit
+vec3 SurfaceNormal(const Intersection& i)
+{
+	if(i.instanceIndex < 0)
+		return triangles[i.triangleIndex].normal;
+	return instancedScene.instances[i.instanceIndex].normalMatrix * HitTriangle(i).normal;
+}
+
+// Loads enemy1.stl once and places count instances of it in a grid inside the Cornell box
+void AddInstances(int count)
+{
+	if(count <= 0)
+		return;
+
+	vector<Triangle> meshTriangles;
+	LoadSTL customModel;
+	customModel.LoadSTLFile(meshTriangles, ENEMY_MODEL_PATH.c_str());
+	int mesh = instancedScene.AddMesh(meshTriangles);
+
+	int side = (int) ceil(sqrt((float) count));
+	float cell = 1.6f / side;
+	float scale = cell / 2.2f; // The model is about 2 units wide
+	for(int i = 0; i < count; i++)
 	{
-		// Move camera backward
-		cameraPos -= 0.1f*forward;
-		isUpdated = true;
+		float angle = i * 0.7f;
+		mat4 transform(1.0f);
+		transform[0][0] = cos(angle) * scale;
+		transform[0][2] = -sin(angle) * scale;
+		transform[1][1] = scale;
+		transform[2][0] = sin(angle) * scale;
+		transform[2][2] = cos(angle) * scale;
+		transform[3] = glm::vec4(-0.8f + cell * (i % side + 0.5f), 0.3f, -0.8f + cell * (i / side + 0.5f), 1.0f);
+		instancedScene.AddInstance(mesh, transform);
 	}
-	if( keystate[SDLK_LEFT] )
+	instancedScene.BuildTopLevel();
+	lightmap.Invalidate();
+	gBufferValid = false;
+
+	size_t meshBytes = instancedScene.MeshMemoryUsage();
+	size_t instanceBytes = instancedScene.InstanceMemoryUsage();
+	cout << "Placed " << count << " instances of " << meshTriangles.size() << " triangles: " << meshBytes / 1024 << " KB of mesh data and "
+		 << instanceBytes / 1024 << " KB of instance data (" << (size_t) count * meshBytes / 1024 << " KB if flattened)" << endl;
+}
+
+// Shadow ray query. Returns true as soon as anything blocks the ray between tMin and tMax.
+// If blocker is given its triangleIndex and instanceIndex are set to the triangle that blocked it
+bool Occluded(vec3 start, vec3 dir, float tMin, float tMax, Hit* blocker)
+{
+	int* triangle = blocker ? &blocker->triangleIndex : 0;
+	bool occluded = false;
+	switch(ACCELERATOR)
 	{
-		// Rotate camera to the left
-		yaw += 0.1f;
-		isUpdated = true;
+		case ACCEL_BVH2: occluded = bvh.Occluded(triangleStore, start, dir, tMin, tMax, triangle); break;
+		case ACCEL_BVH4: occluded = wideBVH.Occluded(triangleStore, start, dir, tMin, tMax, triangle); break;
+		case ACCEL_QBVH4: occluded = compressedBVH.Occluded(triangleStore, start, dir, tMin, tMax, triangle); break;
+		case ACCEL_KDTREE: occluded = kdTree.Occluded(start, dir, tMin, tMax, triangle); break;
+		case ACCEL_GRID: occluded = grid.Occluded(start, dir, tMin, tMax, triangle); break;
+		case ACCEL_BRUTE: occluded = triangleStore.OccludedRange(0, triangleStore.count, start, dir, tMin, tMax, triangle); break;
 	}
-	else if( keystate[SDLK_RIGHT] )
+	if(occluded)
 	{
-		// Rotate camera to the right
-		yaw -= 0.1f;
-		isUpdated = true;
+		if(blocker)
+			blocker->instanceIndex = -1;
+		return true;
 	}
+	return instancedScene.Occluded(start, dir, tMin, tMax, blocker);
+}
 
-	// Update camera rotation matrix
-	float c = cos(yaw);
-	float s = sin(yaw);
-	cameraRot[0][0] = c;
-	cameraRot[0][2] = s;
-	cameraRot[2][0] = -s;
-	cameraRot[2][2] = c;
-	
+// Shadow query for one light sample (slot is light*SOFT_SHADOWS_SAMPLES + sample) that first tests the triangle
+// which last blocked that sample on this thread. It is only tried while the sample's rays keep
+// being blocked, so lit regions don't pay for a test that would miss. The cached test is exact,
+// so the answer is always the same as Occluded's
+bool CachedOccluded(const ShadowRay& ray, int slot)
+{
+	if(!OCCLUDER_CACHE_ENABLED)
+		return Occluded(ray.origin, ray.dir, 0.0f, ray.tMax);
 
-	// Light movement controls
-	if (keystate[SDLK_w])
+	OccluderCache& cache = occluderCaches[ThreadIndex()];
+	Occluder& last = cache.last[slot];
+	cache.queries++;
+	if(last.blocked)
 	{
-		lights[0].position += 0.1f*forward;
-		for(int i = 0; i < SOFT_SHADOWS_SAMPLES; i++)
+		bool blocked;
+		if(last.instanceIndex < 0)
+			blocked = TriangleStore::OccludedBy(triangles[last.triangleIndex], ray.origin, ray.dir, 0.0f, ray.tMax);
+		else
+			blocked = instancedScene.OccludedBy(last.instanceIndex, last.triangleIndex, ray.origin, ray.dir, 0.0f, ray.tMax);
+		if(blocked)
 		{
-			randomPositions[i] += 0.1f*forward;
+			cache.occluded++;
+			cache.hits++;
+			return true;
 		}
-		isUpdated = true;
 	}
-	else if (keystate[SDLK_s])
+
+	Hit blocker;
+	last.blocked = Occluded(ray.origin, ray.dir, 0.0f, ray.tMax, &blocker);
+	if(!last.blocked)
+		return false;
+	last.triangleIndex = blocker.triangleIndex;
+	last.instanceIndex = blocker.instanceIndex;
+	cache.occluded++;
+	return true;
+}
+
+// Empties every thread's occluder cache and zeroes its counters. Done before each frame, since
+// a new scene can leave cached indices pointing past the end of the triangles
+void ResetOccluderCaches()
+{
+	occluderCaches.resize(max(max(omp_get_max_threads(), tilePool.Threads()), 1));
+	for(size_t c = 0; c < occluderCaches.size(); c++)
 	{
-		lights[0].position -= 0.1f*forward;
-		for(int i = 0; i < SOFT_SHADOWS_SAMPLES; i++)
+		OccluderCache& cache = occluderCaches[c];
+		cache.last.resize(lights.size() * SOFT_SHADOWS_SAMPLES);
+		for(size_t i = 0; i < cache.last.size(); i++)
 		{
-			randomPositions[i] -= 0.1f*forward;
+			cache.last[i].triangleIndex = -1;
+			cache.last[i].blocked = false;
 		}
-		isUpdated = true;
+		cache.queries = 0;
+		cache.occluded = 0;
+		cache.hits = 0;
 	}
+}
 
-	// Light movement controls
-	if (keystate[SDLK_a])
+// How many of the shadow rays traced since the caches were reset were answered by the cached triangle
+void PrintOccluderCacheStats()
+{
+	long long queries = 0, occluded = 0, hits = 0;
+	for(size_t c = 0; c < occluderCaches.size(); c++)
 	{
-		lights[0].position -= 0.1f*right;
-		for(int i = 0; i < SOFT_SHADOWS_SAMPLES; i++)
-		{
-			randomPositions[i] -= 0.1f*right;
-		}
-		isUpdated = true;
+		queries += occluderCaches[c].queries;
+		occluded += occluderCaches[c].occluded;
+		hits += occluderCaches[c].hits;
 	}
-	else if (keystate[SDLK_d])
+	if(queries == 0)
+		return;
+
+	cout << "Occluder cache: " << hits << " of " << queries << " shadow rays answered without traversal (" << 100.0 * hits / queries << "%, "
+		 << (occluded > 0 ? 100.0 * hits / occluded : 0.0) << "% of the " << occluded << " blocked ones)" << endl;
+}
+
+// How busy each thread of the tile pool was while it ran the frame's passes, as a share of their time
+void PrintTilePoolStats()
+{
+	const vector<TileThreadStats>& stats = tilePool.Stats();
+	double wall = tilePool.WallTime();
+	if(wall <= 0.0)
+		return;
+
+	int tiles = 0, steals = 0;
+	double busy = 0.0;
+	for(size_t i = 0; i < stats.size(); i++)
 	{
-		lights[0].position += 0.1f*right;
-		for(int i = 0; i < SOFT_SHADOWS_SAMPLES; i++)
-		{
-			randomPositions[i] += 0.1f*right;
-		}
-		isUpdated = true;
+		tiles += stats[i].tiles;
+		steals += stats[i].steals;
+		busy += stats[i].busy;
 	}
+	cout << "Tile pool: " << tiles << " tiles on " << stats.size() << " threads in " << wall * 1000.0 << " ms, " << steals << " steals, "
+		 << 100.0 * busy / (wall * stats.size()) << "% utilisation (";
+	for(size_t i = 0; i < stats.size(); i++)
+		cout << (i > 0 ? " " : "") << (int) (100.0 * stats[i].busy / wall + 0.5) << "%";
+	cout << ")" << endl;
+}
 
-	// Need to check if key has been released to stop the option toggling every frame
-	if(!AA_key_pressed && keystate[SDLK_7])
+// Index of the calling thread among those rendering, whether it belongs to the tile pool or OpenMP
+int ThreadIndex()
+{
+	int index = TilePool::CurrentThread();
+	return index >= 0 ? index : omp_get_thread_num();
+}
+
+// Returns a random number between -0.5 and 0.5
+float RandomNumber(Random& random)
+{
+	return random.Next() - 0.5f;
+}
+
+// Shadow ray from one sample of a light to the point, with the light it brings if nothing blocks it.
+// normal is the unit surface normal at the point
+ShadowRay LightSample(vec3 point, vec3 normal, int light, int sample, int samples, vec2 rotation)
+{
+	vec3 position;
+	vec3 lightColor = lights[light].color * lights[light].intensity;
+
+	if(samples != 1)
 	{
-		AA_ENABLED = !AA_ENABLED;
-		cout << "Antialiasing toggled to " << AA_ENABLED << endl;
-		AA_key_pressed = true;
-		isUpdated = true;
+		position = lights[light].SamplePosition(SoftShadowSample(sample, samples, rotation));
 	}
-	else if (!keystate[SDLK_7])
+	else
 	{
-		AA_key_pressed = false;
+		position = lights[light].position;
 	}
 
-	if(!shadows_key_pressed && keystate[SDLK_8])
-	{
-		SOFT_SHADOWS_ENABLED = !SOFT_SHADOWS_ENABLED;
-		cout << "Soft Shadows toggled to " << SOFT_SHADOWS_ENABLED << endl;
-		shadows_key_pressed = true;
-		isUpdated = true;
-	}
+	// r is distance from lightPos and intersection pos
+	float r = glm::distance(point, position);
+	float A = 4*M_PI*(r*r);
+	vec3 P = lightColor / (float) samples;
+	// unit vector of direction from surface to light
+	vec3 rDir = glm::normalize(position - point);
+	vec3 B = P/A;
+
+	// direct light intensity
+	ShadowRay ray;
+	ray.contribution = B * max(glm::dot(rDir,normal), 0.0f);
+
+	// direct shadows
+	// to avoid comparing with self, trace from light and reverse direction. Anything
+	// closer to the light source than self blocks it (small multiplier to reduce noise)
+	ray.origin = position;
+	ray.dir = -rDir;
+	ray.tMax = r*0.99f;
+	return ray;
+}
+
+// Light reaching a point from every light sample that isn't blocked, before the surface colour
+// is applied. normal is the unit surface normal at the point
+vec3 Irradiance(vec3 position, vec3 nDir, vec2 rotation)
+{
+	int samples;
+	vec3 result(0.0f,0.0f,0.0f);
+
+	if(SOFT_SHADOWS_ENABLED)
+		samples = SOFT_SHADOWS_SAMPLES;
+	else
+		samples = 1;
+
+	// With many lights, a few shadow rays go to lights picked from the tree
+	if(LightTreeInUse())
+	{
+		for(int j = 0; j < LIGHT_TREE_SAMPLES; j++)
+		{
+			int slot;
+			ShadowRay ray = TreeLightSample(position, nDir, j, slot, rotation);
+			if(ray.contribution != vec3(0.0f) && !CachedOccluded(ray, slot))
+				result += ray.contribution;
+		}
+		return result;
+	}
+
+	for(int k = 0; k < (int) lights.size(); k++)
+	{
+		for(int counter = 0; counter < samples; counter++)
+		{
+			// Points facing away from the light get nothing from it, so their shadow ray is skipped
+			ShadowRay ray = LightSample(position, nDir, k, counter, samples, rotation);
+			if(ray.contribution != vec3(0.0f) && !CachedOccluded(ray, k*SOFT_SHADOWS_SAMPLES + counter))
+				result += ray.contribution;
+		}
+	}
+	return result;
+}
+
+bool LightTreeInUse()
+{
+	return LIGHT_TREE_ENABLED && (int) lights.size() > LIGHT_TREE_SAMPLES;
+}
+
+// Shadow ray j of the LIGHT_TREE_SAMPLES fired from a point at lights picked from the light tree,
+// with one of the picked light's soft shadow samples. Its contribution is divided by how likely
+// that light and sample were to be picked, so the rays add up to the light from every sample on
+// average. slot is set to the occluder cache slot of the sample. The picks are stratified over
+// the tree and only depend on the point, so a surface gets the same noise every frame
+ShadowRay TreeLightSample(vec3 point, vec3 normal, int j, int& slot, vec2 rotation)
+{
+	// Keyed on the point, so every thread picks the same lights for it. The first value offsets
+	// all of the point's stratified picks, and value j + 1 chooses pick j's soft shadow sample
+	uint32_t bits[3];
+	memcpy(bits, &point, sizeof(bits));
+	Random random(bits[0], bits[1], bits[2]);
+	float u = (j + random.At(0)) / LIGHT_TREE_SAMPLES;
+
+	ShadowRay ray;
+	int light;
+	float pdf = lightTree.Sample(point, normal, u, light);
+	if(pdf <= 0.0f)
+	{
+		slot = 0;
+		ray.contribution = vec3(0.0f);
+		return ray;
+	}
+
+	int samples = SOFT_SHADOWS_ENABLED ? SOFT_SHADOWS_SAMPLES : 1;
+	int sample = min(samples - 1, (int) (random.At(j + 1) * samples));
+	slot = light*SOFT_SHADOWS_SAMPLES + sample;
+	ray = LightSample(point, normal, light, sample, samples, rotation);
+	ray.contribution *= (float) samples / (pdf * LIGHT_TREE_SAMPLES);
+	return ray;
+}
+
+// Point sample of samples on a light, in [0,1)^2. The Hammersley points put one sample in each
+// of samples strips along both axes, and the whole pattern is shifted by rotation, wrapping
+// around, so it stays stratified while every pixel gets different points
+vec2 SoftShadowSample(int sample, int samples, vec2 rotation)
+{
+	uint32_t bits = sample;
+	bits = (bits << 16) | (bits >> 16);
+	bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+	bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+	bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+	bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+	vec2 point((sample + 0.5f) / samples, bits * (1.0f / 4294967296.0f));
+	point += rotation;
+	return point - glm::floor(point);
+}
+
+// Blue noise shift of the soft shadow pattern for one sample of a pixel. Each further sample
+// of the pixel is moved along the R2 sequence so they don't all use the same points
+vec2 SampleRotation(int x, int y, int sample)
+{
+	vec2 rotation(blueNoise[0].At(x, y) + sample * 0.7548776662f, blueNoise[1].At(x, y) + sample * 0.5698402910f);
+	return rotation - glm::floor(rotation);
+}
+
+// normal is the unit surface normal at the hit
+vec3 DirectLight(const Intersection& i, vec3 normal, vec2 rotation)
+{
+	// Instances aren't in the lightmap, so their light is always traced
+	vec3 result;
+	if(i.instanceIndex < 0 && LightmapInUse())
+		result = lightmap.Lookup(i.triangleIndex, i.u, i.v);
+	else
+		result = Irradiance(i.position, normal, rotation);
+
+	// diffuse
+	// the color stored in the triangle is the reflected fraction of light
+	vec3 p = HitTriangle(i).color;
+	return result*p;
+}
+
+bool LightmapInUse()
+{
+	return LIGHTMAP_ENABLED && lightmap.valid;
+}
+
+// Bakes the light at every lightmap texel of the scene triangles, with the shadow sampling
+// DirectLight would use. Instances still cast shadows into it
+void BakeLightmap()
+{
+	double start = omp_get_wtime();
+	lightmap.Allocate(triangles);
+
+	tilePool.For(triangles.size(), 16, [&]( int begin, int end )
+	{
+		for(int t = begin; t < end && !renderThread.Cancelled(); t++)
+		{
+			const Triangle& triangle = triangles[t];
+			vec3 normal = glm::normalize(triangle.normal);
+			int res = lightmap.res[t];
+			vec3* texel = &lightmap.texels[lightmap.first[t]];
+			for(int j = 0; j <= res; j++)
+			{
+				for(int i = 0; i <= res - j; i++)
+					*texel++ = Irradiance(Lightmap::TexelPosition(triangle, res, i, j), normal, SampleRotation(i, j, t));
+			}
+		}
+	});
+	if(renderThread.Cancelled())
+		return;
+	lightmap.valid = true;
+
+	cout << "Baked " << lightmap.texels.size() << " lightmap texels over " << triangles.size() << " triangles in "
+		 << (omp_get_wtime() - start) * 1000.0 << " ms (" << lightmap.MemoryUsage() / 1024 << " KB)" << endl;
+}
+
+// Final colour of a primary ray hit. normal is the unit surface normal at the hit
+vec3 Shade(const Intersection& i, vec3 normal, vec2 rotation)
+{
+	// if intersect, use color of closest triangle
+	vec3 D = DirectLight(i, normal, rotation);
+	vec3 N = indirectLight;
+	vec3 T = D + N;
+	vec3 p = HitTriangle(i).color;
+	return p*T;
+}
+
+void Update()
+{
+	int t2 = SDL_GetTicks();
+
+	// Reset intersection distances
+	float m = std::numeric_limits<float>::max();
+	for(int i = 0; i < SCREEN_WIDTH*SCREEN_HEIGHT; i++)
+	{
+		closestIntersections[i].distance = m;
+	}
+
+	// Adjust camera transform
+	vec3 right(cameraRot[0][0], cameraRot[0][1], cameraRot[0][2]);
+	vec3 down(cameraRot[1][0], cameraRot[1][1], cameraRot[1][2]);
+	vec3 forward(cameraRot[2][0], cameraRot[2][1], cameraRot[2][2]);
+	Uint8* keystate = SDL_GetKeyState( 0 );
+	
+	if( keystate[SDLK_UP] )
+	{
+		// Move camera forward
+		cameraPos += 0.1f*forward;
+		gBufferValid = false;
+		isUpdated = true;
+	}
+	else if( keystate[SDLK_DOWN] )
+	{
+		// Move camera backward
+		cameraPos -= 0.1f*forward;
+		gBufferValid = false;
+		isUpdated = true;
+	}
+	if( keystate[SDLK_LEFT] )
+	{
+		// Rotate camera to the left
+		yaw += 0.1f;
+		gBufferValid = false;
+		isUpdated = true;
+	}
+	else if( keystate[SDLK_RIGHT] )
+	{
+		// Rotate camera to the right
+		yaw -= 0.1f;
+		gBufferValid = false;
+		isUpdated = true;
+	}
+
+	// Update camera rotation matrix
+	float c = cos(yaw);
+	float s = sin(yaw);
+	cameraRot[0][0] = c;
+	cameraRot[0][2] = s;
+	cameraRot[2][0] = -s;
+	cameraRot[2][2] = c;
+	
+
+	// Light movement controls
+	if (!lights.empty() && keystate[SDLK_w])
+	{
+		lights[0].position += 0.1f*forward;
+		lightmap.Invalidate();
+		lightTree.Invalidate();
+		isUpdated = true;
+	}
+	else if (!lights.empty() && keystate[SDLK_s])
+	{
+		lights[0].position -= 0.1f*forward;
+		lightmap.Invalidate();
+		lightTree.Invalidate();
+		isUpdated = true;
+	}
+
+	// Light movement controls
+	if (!lights.empty() && keystate[SDLK_a])
+	{
+		lights[0].position -= 0.1f*right;
+		lightmap.Invalidate();
+		lightTree.Invalidate();
+		isUpdated = true;
+	}
+	else if (!lights.empty() && keystate[SDLK_d])
+	{
+		lights[0].position += 0.1f*right;
+		lightmap.Invalidate();
+		lightTree.Invalidate();
+		isUpdated = true;
+	}
+
+	// Need to check if key has been released to stop the option toggling every frame
+	if(!AA_key_pressed && keystate[SDLK_7])
+	{
+		AA_ENABLED = !AA_ENABLED;
+		cout << "Antialiasing toggled to " << AA_ENABLED << endl;
+		gBufferValid = false;
+		AA_key_pressed = true;
+		isUpdated = true;
+	}
+	else if (!keystate[SDLK_7])
+	{
+		AA_key_pressed = false;
+	}
+
+	if(!progressive_key_pressed && keystate[SDLK_r])
+	{
+		PROGRESSIVE_ENABLED = !PROGRESSIVE_ENABLED;
+		cout << "Progressive rendering toggled to " << PROGRESSIVE_ENABLED << endl;
+		gBufferValid = false;
+		progressive_key_pressed = true;
+		isUpdated = true;
+	}
+	else if (!keystate[SDLK_r])
+	{
+		progressive_key_pressed = false;
+	}
+
+	if(!adaptive_AA_key_pressed && keystate[SDLK_k])
+	{
+		ADAPTIVE_AA_ENABLED = !ADAPTIVE_AA_ENABLED;
+		cout << "Adaptive antialiasing toggled to " << ADAPTIVE_AA_ENABLED << endl;
+		gBufferValid = false;
+		adaptive_AA_key_pressed = true;
+		isUpdated = true;
+	}
+	else if (!keystate[SDLK_k])
+	{
+		adaptive_AA_key_pressed = false;
+	}
+
+	if(!shadows_key_pressed && keystate[SDLK_8])
+	{
+		SOFT_SHADOWS_ENABLED = !SOFT_SHADOWS_ENABLED;
+		cout << "Soft Shadows toggled to " << SOFT_SHADOWS_ENABLED << endl;
+		lightmap.Invalidate();
+		shadows_key_pressed = true;
+		isUpdated = true;
+	}
 	else if (!keystate[SDLK_8])
 	{
 		shadows_key_pressed = false;
@@ -519,7 +1559,7 @@ void Update()
 
 	if(!add_light_key_pressed && keystate[SDLK_2])
 	{
-		AddLight(vec3(RandomNumber() * 2.0f, RandomNumber() * 2.0f, RandomNumber() * 2.0f),vec3(abs(RandomNumber()) * 2.0f + 0.2f,abs(RandomNumber()) * 2.0f + 0.2f,abs(RandomNumber()) * 2.0f + 0.2f),abs(RandomNumber()) * 20.0f);
+		AddRandomLight();
 		cout << "Spawned a light" << endl;
 		add_light_key_pressed = true;
 		isUpdated = true;
@@ -529,6 +1569,117 @@ void Update()
 		add_light_key_pressed = false;
 	}
 
+	if(!packets_key_pressed && keystate[SDLK_p])
+	{
+		PACKETS_ENABLED = !PACKETS_ENABLED;
+		cout << "Ray packets toggled to " << PACKETS_ENABLED << endl;
+		gBufferValid = false;
+		packets_key_pressed = true;
+		isUpdated = true;
+	}
+	else if (!keystate[SDLK_p])
+	{
+		packets_key_pressed = false;
+	}
+
+	if(!wavefront_key_pressed && keystate[SDLK_v])
+	{
+		WAVEFRONT_ENABLED = !WAVEFRONT_ENABLED;
+		cout << "Wavefront rendering toggled to " << WAVEFRONT_ENABLED << endl;
+		gBufferValid = false;
+		wavefront_key_pressed = true;
+		isUpdated = true;
+	}
+	else if (!keystate[SDLK_v])
+	{
+		wavefront_key_pressed = false;
+	}
+
+	if(!occluder_cache_key_pressed && keystate[SDLK_o])
+	{
+		OCCLUDER_CACHE_ENABLED = !OCCLUDER_CACHE_ENABLED;
+		cout << "Occluder cache toggled to " << OCCLUDER_CACHE_ENABLED << endl;
+		occluder_cache_key_pressed = true;
+		isUpdated = true;
+	}
+	else if (!keystate[SDLK_o])
+	{
+		occluder_cache_key_pressed = false;
+	}
+
+	if(!lightmap_key_pressed && keystate[SDLK_l])
+	{
+		LIGHTMAP_ENABLED = !LIGHTMAP_ENABLED;
+		cout << "Lightmap toggled to " << LIGHTMAP_ENABLED << endl;
+		lightmap_key_pressed = true;
+		isUpdated = true;
+	}
+	else if (!keystate[SDLK_l])
+	{
+		lightmap_key_pressed = false;
+	}
+
+	if(!light_tree_key_pressed && keystate[SDLK_i])
+	{
+		LIGHT_TREE_ENABLED = !LIGHT_TREE_ENABLED;
+		cout << "Light tree toggled to " << LIGHT_TREE_ENABLED << endl;
+		lightmap.Invalidate();
+		light_tree_key_pressed = true;
+		isUpdated = true;
+	}
+	else if (!keystate[SDLK_i])
+	{
+		light_tree_key_pressed = false;
+	}
+
+	if(!hybrid_key_pressed && keystate[SDLK_h])
+	{
+		HYBRID_ENABLED = !HYBRID_ENABLED;
+		cout << "Hybrid rendering toggled to " << HYBRID_ENABLED << endl;
+		gBufferValid = false;
+		hybrid_key_pressed = true;
+		isUpdated = true;
+	}
+	else if (!keystate[SDLK_h])
+	{
+		hybrid_key_pressed = false;
+	}
+
+	if(!accelerator_key_pressed && keystate[SDLK_b])
+	{
+		ACCELERATOR = (Accelerator) ((ACCELERATOR + 1) % NUM_ACCELERATORS);
+		cout << "Acceleration structure switched to " << ACCELERATOR_NAMES[ACCELERATOR] << endl;
+		gBufferValid = false;
+		if(ACCELERATOR == ACCEL_KDTREE && kdTree.Empty() && !triangles.empty())
+			kdTree.Build(triangles);
+		accelerator_key_pressed = true;
+		isUpdated = true;
+	}
+	else if (!keystate[SDLK_b])
+	{
+		accelerator_key_pressed = false;
+	}
+
+	if(!animation_key_pressed && keystate[SDLK_m])
+	{
+		ANIMATION_ENABLED = !ANIMATION_ENABLED;
+		cout << "Animation toggled to " << ANIMATION_ENABLED << endl;
+		animation_key_pressed = true;
+		isUpdated = true;
+	}
+	else if (!keystate[SDLK_m])
+	{
+		animation_key_pressed = false;
+	}
+
+	// Move the animated triangles and refit the acceleration structures around them
+	if(ANIMATION_ENABLED)
+	{
+		AnimateTriangles(t2 / 1000.0f);
+		UpdateAccelerators();
+		isUpdated = true;
+	}
+
 	if(!delete_light_key_pressed && keystate[SDLK_3])
 	{
 		DeleteLight();
@@ -544,113 +1695,879 @@ void Update()
 
 }
 
+// Runs the job on the render thread with the current number of threads, remembering the keys
+// held when it started
+void StartRender(void (*job)())
+{
+	int count;
+	Uint8* keystate = SDL_GetKeyState(&count);
+	renderKeys.assign(keystate, keystate + count);
+	t = SDL_GetTicks();
+
+	// The OpenMP thread count is set per thread, so the render thread takes it from here
+	int threads = NUM_THREADS;
+	renderThread.Start([job, threads]{ omp_set_num_threads(threads); tilePool.Resize(threads); job(); });
+}
+
+// Whether a key has gone down since the frame in flight was started. Keys held since then are
+// handled once it finishes, so holding one steps through finished frames as before
+bool NewKeyPressed()
+{
+	Uint8* keystate = SDL_GetKeyState(0);
+	for(size_t k = 0; k < renderKeys.size(); k++)
+	{
+		if(keystate[k] && !renderKeys[k])
+			return true;
+	}
+	return false;
+}
+
+// Job for a whole new frame
+void RenderFrame()
+{
+	Draw();
+	if(renderThread.Cancelled())
+	{
+		// Parts of the G-buffer may not have been traced
+		gBufferValid = false;
+		return;
+	}
+	PrintOccluderCacheStats();
+	PrintTilePoolStats();
+	ResetAccumulation();
+}
+
+// Shows the frame the render thread finished. Only the thread that owns the window may draw to it
+void PresentFrame()
+{
+	cout << "Render time: " << SDL_GetTicks() - t << " ms." << endl;
+
+	if( SDL_MUSTLOCK(screen) )
+		SDL_LockSurface(screen);
+
+	for (int y = 1; y < SCREEN_HEIGHT - 1; y++)
+	{
+		for (int x = 1; x < SCREEN_WIDTH - 1; x++)
+			PutPixelSDL( screen, x, y, blurredPixels[y*SCREEN_HEIGHT+x] );
+	}
+
+	if( SDL_MUSTLOCK(screen) )
+		SDL_UnlockSurface(screen);
+
+	SDL_UpdateRect( screen, 0, 0, 0, 0 );
+}
+
 void Draw()
 {
 	int realSamples; // Number of AA samples to use. Set to 1 if AA is disabled
 
-	if(AA_ENABLED)
+	if(AA_ENABLED && !PROGRESSIVE_ENABLED)
 		realSamples = AA_SAMPLES;
 	else
 		realSamples = 1;
 
+	if(!lightTree.valid)
+		BuildLightTree();
+	ResetOccluderCaches();
+	tilePool.ResetStats();
+
+	if(LIGHTMAP_ENABLED && !ANIMATION_ENABLED && !lightmap.valid)
+		BakeLightmap();
+
+	// Only the lights changed since the primary hits were traced, so just light them again
+	int samplesPerPixel = realSamples * realSamples;
+	if(gBufferValid && gBuffer.size() == (size_t) SCREEN_WIDTH * SCREEN_HEIGHT * samplesPerPixel)
+	{
+		DrawLighting(realSamples);
+		CalculateDOF();
+		return;
+	}
+	gBufferValid = true; // Filled in by whichever path traces the primary rays below
+
+	// Adaptive AA starts from one sample per pixel and supersamples the edges it finds in them
+	if(AdaptiveAAInUse(realSamples))
+	{
+		gBuffer.resize(SCREEN_WIDTH * SCREEN_HEIGHT);
+		DrawPrimary(1);
+		if(!renderThread.Cancelled())
+			SupersampleEdges(realSamples);
+	}
+	else
+	{
+		gBuffer.resize(SCREEN_WIDTH * SCREEN_HEIGHT * samplesPerPixel);
+		DrawPrimary(realSamples);
+	}
+
+	CalculateDOF();
+}
+
+// Starts progressive rendering again from the frame Draw just made, as its first sample
+void ResetAccumulation()
+{
+	accumulation.assign(pixelColours, pixelColours + SCREEN_WIDTH * SCREEN_HEIGHT);
+	accumulatedSamples = 1;
+}
+
+// Adds one more sample to every pixel of the accumulation and shows the average. The ray goes
+// through the next point of the R2 sequence within the pixel, and the soft shadow pattern of
+// the pixel moves on by one sample as it would for the next AA sample
+void DrawProgressive()
+{
+	int sample = accumulatedSamples;
+	vec2 jitter(sample * 0.7548776662f, sample * 0.5698402910f);
+	jitter = jitter - glm::floor(jitter) - vec2(0.5f);
+
+	ResetOccluderCaches();
+
+	tilePool.Run(SCREEN_WIDTH, SCREEN_HEIGHT, TILE_SIZE, [&]( const Tile& tile )
+	{
+		if(renderThread.Cancelled())
+			return;
+		for (int y = tile.y0; y < tile.y1; y++)
+		{
+			for (int x = tile.x0; x < tile.x1; x++)
+			{
+				int p = y*SCREEN_HEIGHT + x;
+				Hit hit;
+				hit.t = std::numeric_limits<float>::max();
+				hit.triangleIndex = -1;
+				hit.instanceIndex = -1;
+				vec3 d(x + jitter.x - (float)SCREEN_WIDTH/2.0f, y + jitter.y - (float)SCREEN_HEIGHT/2.0f, focalLength);
+				if(TraceClosest(cameraPos, cameraRot*d, hit))
+				{
+					Intersection intersection;
+					FillIntersection(cameraPos, hit, intersection);
+					accumulation[p] += Shade(intersection, glm::normalize(SurfaceNormal(intersection)), SampleRotation(x, y, sample));
+				}
+				pixelColours[p] = accumulation[p] / (float) (sample + 1);
+			}
+		}
+	});
+
+	// The accumulation is only partly added to, so it is started again with the next frame
+	if(renderThread.Cancelled())
+		return;
+	accumulatedSamples++;
+	CalculateDOF();
+	if(accumulatedSamples == PROGRESSIVE_MAX_SAMPLES)
+		cout << "Progressive rendering converged at " << accumulatedSamples << " samples per pixel" << endl;
+}
+
+// Traces and shades every sample of every pixel with whichever path is enabled, filling the G-buffer
+void DrawPrimary(int realSamples)
+{
+	if(HYBRID_ENABLED)
+		DrawHybrid(realSamples);
+	else if(WAVEFRONT_ENABLED)
+		DrawWavefront(realSamples);
+	else if(PACKETS_ENABLED)
+		DrawPackets(realSamples);
+	else
+		DrawPixels(realSamples);
+}
+
+// One ray per sample, pixel by pixel
+void DrawPixels(int realSamples)
+{
+	int samplesPerPixel = realSamples * realSamples;
+
 	// This is the loop that needs parallelisation
-	#pragma omp parallel for schedule(auto)
-	for (int y = 0; y < SCREEN_HEIGHT; y++)
+	tilePool.Run(SCREEN_WIDTH, SCREEN_HEIGHT, TILE_SIZE, [&]( const Tile& tile )
 	{
+		if(renderThread.Cancelled())
+			return;
 		float x1, y1;
-		for (int x = 0; x < SCREEN_WIDTH; x++)
+		for (int y = tile.y0; y < tile.y1; y++)
 		{
-			vec3 avgColor(0.0f,0.0f,0.0f);
-			if(realSamples > 1) 
-				y1 = y - 0.5f;
-			else
-				y1 = y;
-
-			for(int z = 0; z < realSamples; z++)
+			for (int x = tile.x0; x < tile.x1; x++)
 			{
+				vec3 avgColor(0.0f,0.0f,0.0f);
 				if(realSamples > 1) 
-					x1 = x - 0.5f;
+					y1 = y - 0.5f;
 				else
-					x1 = x;
+					y1 = y;
 
-				for(int z2 = 0; z2 < realSamples; z2++)
+				for(int z = 0; z < realSamples; z++)
 				{
-					// work out vectors from rotation
-					vec3 d(x1-(float)SCREEN_WIDTH/2.0f, y1 - (float)SCREEN_HEIGHT/2.0f, focalLength);
-					if ( ClosestIntersection(cameraPos, cameraRot*d, triangles, closestIntersections[y*SCREEN_HEIGHT + x], false, x, y ))
+					if(realSamples > 1) 
+						x1 = x - 0.5f;
+					else
+						x1 = x;
+
+					for(int z2 = 0; z2 < realSamples; z2++)
 					{
-						// if intersect, use color of closest triangle
-						vec3 color = DirectLight(closestIntersections[y*SCREEN_HEIGHT+x]);
-						vec3 D = color;
-						vec3 N = indirectLight;
-						vec3 T = D + N;
-						vec3 p = triangles[closestIntersections[y*SCREEN_HEIGHT+x].triangleIndex].color;
-						vec3 R = p*T;
-
-						// direct shadows cast to point from light
-						avgColor += R;
-
-						x1 += (1.0f / (float) (realSamples - 1));
+						// Every sample looks for its own closest hit
+						closestIntersections[y*SCREEN_HEIGHT + x].distance = std::numeric_limits<float>::max();
+
+						GBufferSample& g = gBuffer[(y*SCREEN_HEIGHT + x)*samplesPerPixel + z*realSamples + z2];
+						g.intersection.triangleIndex = -1;
+
+						// work out vectors from rotation
+						vec3 d(x1-(float)SCREEN_WIDTH/2.0f, y1 - (float)SCREEN_HEIGHT/2.0f, focalLength);
+						if ( ClosestIntersection(cameraPos, cameraRot*d, triangles, closestIntersections[y*SCREEN_HEIGHT + x], false, x, y ))
+						{
+							g.intersection = closestIntersections[y*SCREEN_HEIGHT+x];
+							g.normal = glm::normalize(SurfaceNormal(g.intersection));
+
+							// direct shadows cast to point from light
+							avgColor += Shade(g.intersection, g.normal, SampleRotation(x, y, z*realSamples + z2));
+
+							x1 += (1.0f / (float) (realSamples - 1));
+						}
 					}
+					y1 += (1.0f / (float) (realSamples - 1));
 				}
-				y1 += (1.0f / (float) (realSamples - 1));
+
+				avgColor /= (float)(realSamples * realSamples);
+				pixelColours[y*SCREEN_HEIGHT + x] = avgColor;
+
 			}
+		}
+	});
+}
 
-			avgColor /= (float)(realSamples * realSamples);
-			pixelColours[y*SCREEN_HEIGHT + x] = avgColor;
+bool AdaptiveAAInUse(int realSamples)
+{
+	return ADAPTIVE_AA_ENABLED && realSamples > 1;
+}
+
+// Second pass of adaptive AA, over a G-buffer and image with one sample per pixel. Pixels that
+// differ from a neighbour are traced again with the same realSamples^2 samples as uniform AA,
+// and the G-buffer is spread out to realSamples^2 slots per pixel so DrawLighting can relight it
+void SupersampleEdges(int realSamples)
+{
+	int samplesPerPixel = realSamples * realSamples;
+	float step = 1.0f / (float) (realSamples - 1);
 
+	// The single samples move to the first slot of each pixel
+	gBuffer.resize(SCREEN_WIDTH * SCREEN_HEIGHT * samplesPerPixel);
+	for(int p = SCREEN_WIDTH * SCREEN_HEIGHT - 1; p > 0; p--)
+		gBuffer[p*samplesPerPixel] = gBuffer[p];
+
+	edgePixels.assign(SCREEN_WIDTH * SCREEN_HEIGHT, 0);
+	tilePool.Run(SCREEN_WIDTH, SCREEN_HEIGHT, TILE_SIZE, [&]( const Tile& tile )
+	{
+		for (int y = tile.y0; y < tile.y1; y++)
+		{
+			for (int x = tile.x0; x < tile.x1; x++)
+			{
+				int p = y*SCREEN_HEIGHT + x;
+				const int neighbours[4][2] = { {x - 1, y}, {x + 1, y}, {x, y - 1}, {x, y + 1} };
+				for(int n = 0; n < 4 && !edgePixels[p]; n++)
+				{
+					int nx = neighbours[n][0], ny = neighbours[n][1];
+					if(nx < 0 || ny < 0 || nx >= SCREEN_WIDTH || ny >= SCREEN_HEIGHT)
+						continue;
+					int q = ny*SCREEN_HEIGHT + nx;
+					edgePixels[p] = IsEdge(gBuffer[p*samplesPerPixel], gBuffer[q*samplesPerPixel], pixelColours[p], pixelColours[q]);
+				}
+			}
 		}
+	});
+
+	vector<int> edges;
+	for(int p = 0; p < SCREEN_WIDTH * SCREEN_HEIGHT; p++)
+	{
+		if(edgePixels[p])
+			edges.push_back(p);
 	}
 
-	CalculateDOF();
+	tilePool.For(edges.size(), 16, [&]( int begin, int end )
+	{
+		for(int e = begin; e < end && !renderThread.Cancelled(); e++)
+		{
+			int p = edges[e];
+			int x = p % SCREEN_HEIGHT;
+			int y = p / SCREEN_HEIGHT;
+			vec3 avgColor(0.0f,0.0f,0.0f);
+			for(int z = 0; z < realSamples; z++)
+			{
+				for(int z2 = 0; z2 < realSamples; z2++)
+				{
+					// Same sample offsets within the pixel as DrawPackets
+					float ox = z2*step - 0.5f;
+					float oy = z*step - 0.5f;
+					GBufferSample& g = gBuffer[p*samplesPerPixel + z*realSamples + z2];
+					g.intersection.triangleIndex = -1;
+
+					Hit hit;
+					hit.t = std::numeric_limits<float>::max();
+					hit.triangleIndex = -1;
+					hit.instanceIndex = -1;
+					vec3 d(x + ox - (float)SCREEN_WIDTH/2.0f, y + oy - (float)SCREEN_HEIGHT/2.0f, focalLength);
+					if(!TraceClosest(cameraPos, cameraRot*d, hit))
+						continue;
+
+					Intersection& intersection = closestIntersections[p];
+					FillIntersection(cameraPos, hit, intersection);
+					focalDistances[p] = intersection.distance - FOCAL_LENGTH;
+					g.intersection = intersection;
+					g.normal = glm::normalize(SurfaceNormal(intersection));
+					avgColor += Shade(intersection, g.normal, SampleRotation(x, y, z*realSamples + z2));
+				}
+			}
+			pixelColours[p] = avgColor / (float) samplesPerPixel;
+		}
+	});
+
+	int rays = SCREEN_WIDTH * SCREEN_HEIGHT + edges.size() * samplesPerPixel;
+	cout << "Adaptive AA supersampled " << edges.size() << " of " << SCREEN_WIDTH * SCREEN_HEIGHT << " pixels: " << rays << " primary rays, "
+		 << 100.0 * rays / (SCREEN_WIDTH * SCREEN_HEIGHT * samplesPerPixel) << "% of uniform AA" << endl;
 }
 
-void CalculateDOF()
+// Whether two neighbouring single samples straddle an edge worth supersampling: one hit and the
+// other missed, they are on different surfaces, or their colours differ by more than
+// ADAPTIVE_AA_CONTRAST, which catches shadow edges. Neighbouring triangles of one flat surface,
+// like the two halves of a wall, don't count as an edge
+bool IsEdge(const GBufferSample& a, const GBufferSample& b, vec3 colorA, vec3 colorB)
 {
-	if( SDL_MUSTLOCK(screen) )
-		SDL_LockSurface(screen);
+	vec3 contrast = glm::abs(colorA - colorB);
+	if(max(contrast.x, max(contrast.y, contrast.z)) > ADAPTIVE_AA_CONTRAST)
+		return true;
+
+	const Intersection& i = a.intersection;
+	const Intersection& j = b.intersection;
+	if((i.triangleIndex < 0) != (j.triangleIndex < 0))
+		return true;
+	if(i.triangleIndex < 0 || (i.triangleIndex == j.triangleIndex && i.instanceIndex == j.instanceIndex))
+		return false;
+	if(glm::dot(a.normal, b.normal) < 0.999f)
+		return true;
+	return fabsf(glm::dot(j.position - i.position, a.normal)) > 1e-3f * i.distance;
+}
 
-	// Total number of pixels in the kernel
-	float totalPixels = DOF_KERNEL_SIZE * DOF_KERNEL_SIZE;
+// Same as the per pixel loop in Draw, but primary rays are traced as packets covering a square block of pixels
+void DrawPackets(int realSamples)
+{
+	float step = (realSamples > 1) ? 1.0f / (float) (realSamples - 1) : 0.0f;
 
-	// Spawn threads
-	#pragma omp parallel for schedule(auto)
-	for (int y = 1; y < SCREEN_HEIGHT - 1; y++)
+	// Each tile is one packet's block
+	tilePool.Run(SCREEN_WIDTH, SCREEN_HEIGHT, RayPacket::BLOCK_SIZE, [&]( const Tile& tile )
 	{
-		for (int x = 1; x < SCREEN_WIDTH - 1; x++)
+		if(renderThread.Cancelled())
+			return;
+		int xStart = tile.x0;
+		int yStart = tile.y0;
+		int xEnd = tile.x1;
+		int yEnd = tile.y1;
+
+		RayPacket packet;
+		vec3 avgColors[RayPacket::MAX_RAYS];
+		for(int r = 0; r < RayPacket::MAX_RAYS; r++)
+			avgColors[r] = vec3(0.0f,0.0f,0.0f);
+
+		for(int z = 0; z < realSamples; z++)
 		{
-			vec3 finalColour(0.0f,0.0f,0.0f);
-			if(DOF_ENABLED)
+			for(int z2 = 0; z2 < realSamples; z2++)
 			{
-				// Start from top left of kernel
-				for(int z = ceil(DOF_KERNEL_SIZE / -2.0f); z < ceil(DOF_KERNEL_SIZE / 2.0f); z++)
+				// Same sample offsets within the pixel as the single ray path
+				float ox = (realSamples > 1) ? z2*step - 0.5f : 0.0f;
+				float oy = (realSamples > 1) ? z*step - 0.5f : 0.0f;
+				float left = xStart + ox - (float)SCREEN_WIDTH/2.0f;
+				float right = (xEnd - 1) + ox - (float)SCREEN_WIDTH/2.0f;
+				float top = yStart + oy - (float)SCREEN_HEIGHT/2.0f;
+				float bottom = (yEnd - 1) + oy - (float)SCREEN_HEIGHT/2.0f;
+
+				packet.Begin(cameraPos);
+				for (int y = yStart; y < yEnd; y++)
 				{
-					for(int z2 = ceil(DOF_KERNEL_SIZE / -2.0f); z2 < ceil(DOF_KERNEL_SIZE / 2.0f); z2++)
+					for (int x = xStart; x < xEnd; x++)
 					{
-						float weighting;
-						if(z == 0 && z2 == 0)
-							weighting = 1 - (min(abs(focalDistances[y*SCREEN_HEIGHT+x]), 1.0f) * ((totalPixels - 1) / totalPixels) );
-						else
-							weighting = min(abs(focalDistances[y*SCREEN_HEIGHT+x]), 1.0f) * (1.0f / totalPixels);
-
-						// Add contribution to final pixel colour
-						finalColour += pixelColours[(y+z)*SCREEN_HEIGHT+(x+z2)] * weighting;
+						vec3 d(x + ox - (float)SCREEN_WIDTH/2.0f, y + oy - (float)SCREEN_HEIGHT/2.0f, focalLength);
+						packet.AddRay(cameraRot*d, std::numeric_limits<float>::max());
 					}
 				}
+
+				vec3 corners[4] = { cameraRot*vec3(left, top, focalLength), cameraRot*vec3(right, top, focalLength),
+									cameraRot*vec3(right, bottom, focalLength), cameraRot*vec3(left, bottom, focalLength) };
+				packet.SetFrustum(corners);
+				TracePacket(packet);
+
+				for(int r = 0; r < packet.count; r++)
+				{
+					int x = xStart + r % (xEnd - xStart);
+					int y = yStart + r / (xEnd - xStart);
+					GBufferSample& g = gBuffer[(y*SCREEN_HEIGHT + x)*realSamples*realSamples + z*realSamples + z2];
+					g.intersection.triangleIndex = -1;
+					if(packet.hit[r].triangleIndex < 0)
+						continue;
+
+					Intersection& intersection = closestIntersections[y*SCREEN_HEIGHT + x];
+					FillIntersection(cameraPos, packet.hit[r], intersection);
+					focalDistances[y*SCREEN_HEIGHT + x] = intersection.distance - FOCAL_LENGTH;
+					g.intersection = intersection;
+					g.normal = glm::normalize(SurfaceNormal(intersection));
+					avgColors[r] += Shade(intersection, g.normal, SampleRotation(x, y, z*realSamples + z2));
+				}
 			}
-			else
+		}
+
+		for(int r = 0; r < (xEnd - xStart) * (yEnd - yStart); r++)
+		{
+			int x = xStart + r % (xEnd - xStart);
+			int y = yStart + r / (xEnd - xStart);
+			pixelColours[y*SCREEN_HEIGHT + x] = avgColors[r] / (float)(realSamples * realSamples);
+		}
+	});
+}
+
+// Closest hits for every ray in the packet from the selected acceleration structure and the instances
+void TracePacket(RayPacket& packet)
+{
+	switch(ACCELERATOR)
+	{
+		case ACCEL_BVH2: bvh.IntersectPacket(triangleStore, packet); break;
+		case ACCEL_BVH4: wideBVH.IntersectPacket(triangleStore, packet); break;
+		case ACCEL_QBVH4:
+			// No packet traversal for the compressed nodes, so the rays go one at a time
+			for(int r = 0; r < packet.count; r++)
+				compressedBVH.Intersect(triangleStore, packet.origin, packet.dir[r], packet.hit[r]);
+			break;
+		case ACCEL_KDTREE:
+			for(int r = 0; r < packet.count; r++)
+				kdTree.Intersect(packet.origin, packet.dir[r], packet.hit[r]);
+			break;
+		case ACCEL_GRID:
+			for(int r = 0; r < packet.count; r++)
+				grid.Intersect(packet.origin, packet.dir[r], packet.hit[r]);
+			break;
+		case ACCEL_BRUTE:
+			for(int r = 0; r < packet.count; r++)
+				triangleStore.IntersectRange(0, triangleStore.count, packet.origin, packet.dir[r], packet.hit[r]);
+			break;
+	}
+
+	// Instances are traced per ray after the packet, bounded by the packet hits
+	if(!instancedScene.Empty())
+	{
+		for(int r = 0; r < packet.count; r++)
+			instancedScene.Intersect(packet.origin, packet.dir[r], packet.hit[r]);
+	}
+}
+
+// Same image as Draw, but each stage runs over a whole wave of pixels before the next one
+// starts: generate every primary ray, trace them all, shade the hits into a queue of shadow
+// rays, bin that queue by light and direction, test it, then add up the light that got
+// through. Rays in the same bin leave the same light in about the same direction, so they
+// walk the same nodes one after another instead of each pixel on its own
+void DrawWavefront(int realSamples)
+{
+	const int B = RayPacket::BLOCK_SIZE;
+	const int R = RayPacket::MAX_RAYS;
+	const uint64_t SKIPPED = 0xffffffffull << 32; // Sorts shadow rays that needn't be traced to the end
+
+	int blocksX = (SCREEN_WIDTH + B - 1) / B;
+	int blocksY = (SCREEN_HEIGHT + B - 1) / B;
+	int samplesPerPixel = realSamples * realSamples;
+	int lightSamples = SOFT_SHADOWS_ENABLED ? SOFT_SHADOWS_SAMPLES : 1;
+	bool lightTreeInUse = LightTreeInUse();
+	int raysPerHit = lightTreeInUse ? LIGHT_TREE_SAMPLES : lights.size() * lightSamples;
+	float step = (realSamples > 1) ? 1.0f / (float) (realSamples - 1) : 0.0f;
+
+	// Waves are made of whole blocks. The queue holds a packet's worth of rays for every block
+	// and sample, laid out as in DrawPackets, with the slots past the edge of the screen unused
+	int waveBlocks = max(1, WAVE_SHADOW_RAYS / (R * samplesPerPixel * max(1, raysPerHit)));
+
+	for(int waveStart = 0; waveStart < blocksX * blocksY && !renderThread.Cancelled(); waveStart += waveBlocks)
+	{
+		int waveEnd = min(waveStart + waveBlocks, blocksX * blocksY);
+		int packets = (waveEnd - waveStart) * samplesPerPixel;
+		primaryQueue.resize(packets * R);
+
+		// Generate the primary rays, with the same sample offsets as DrawPackets
+		tilePool.For(packets * R, R, [&]( int begin, int end )
+		{
+			for(int q = begin; q < end; q++)
 			{
-				finalColour = pixelColours[y*SCREEN_HEIGHT+x];
+				int block = waveStart + q / (R * samplesPerPixel);
+				int sample = (q / R) % samplesPerPixel;
+				int xStart = (block % blocksX) * B;
+				int yStart = (block / blocksX) * B;
+				int width = min(xStart + B, SCREEN_WIDTH) - xStart;
+				int height = min(yStart + B, SCREEN_HEIGHT) - yStart;
+
+				PrimaryRay& ray = primaryQueue[q];
+				ray.hit.t = std::numeric_limits<float>::max();
+				ray.hit.triangleIndex = -1;
+				ray.hit.instanceIndex = -1;
+				if(q % R >= width * height)
+					continue;
+
+				float ox = (realSamples > 1) ? (sample % realSamples)*step - 0.5f : 0.0f;
+				float oy = (realSamples > 1) ? (sample / realSamples)*step - 0.5f : 0.0f;
+				int x = xStart + (q % R) % width;
+				int y = yStart + (q % R) / width;
+				vec3 d(x + ox - (float)SCREEN_WIDTH/2.0f, y + oy - (float)SCREEN_HEIGHT/2.0f, focalLength);
+				ray.dir = cameraRot*d;
+				ray.rotation = SampleRotation(x, y, sample);
 			}
+		});
 
-			PutPixelSDL( screen, x, y, finalColour );
+		// Trace them, as packets when those are enabled
+		tilePool.For(packets, 1, [&]( int begin, int end )
+		{
+			for(int p = begin; p < end; p++)
+			{
+				int block = waveStart + p / samplesPerPixel;
+				int width = min((block % blocksX) * B + B, SCREEN_WIDTH) - (block % blocksX) * B;
+				int height = min((block / blocksX) * B + B, SCREEN_HEIGHT) - (block / blocksX) * B;
+				PrimaryRay* rays = &primaryQueue[p * R];
+
+				if(!PACKETS_ENABLED)
+				{
+					for(int r = 0; r < width * height; r++)
+						TraceClosest(cameraPos, rays[r].dir, rays[r].hit);
+					continue;
+				}
+
+				RayPacket packet;
+				packet.Begin(cameraPos);
+				for(int r = 0; r < width * height; r++)
+					packet.AddRay(rays[r].dir, std::numeric_limits<float>::max());
+				vec3 corners[4] = { rays[0].dir, rays[width - 1].dir, rays[width * height - 1].dir, rays[(height - 1) * width].dir };
+				packet.SetFrustum(corners);
+				TracePacket(packet);
+				for(int r = 0; r < width * height; r++)
+					rays[r].hit = packet.hit[r];
+			}
+		});
+
+		// Only hits get shadow rays, and not the ones the lightmap covers. This scan is left on one
+		// thread: it only reads the primary rays, and takes about 1% of the wave time on one core
+		bool lightmapInUse = LightmapInUse();
+		int shadowRays = 0;
+		for(int q = 0; q < packets * R; q++)
+		{
+			PrimaryRay& ray = primaryQueue[q];
+			ray.shadowFirst = (ray.hit.triangleIndex < 0) ? -1 : shadowRays;
+			ray.baked = lightmapInUse && ray.hit.instanceIndex < 0;
+			if(ray.shadowFirst >= 0 && !ray.baked)
+				shadowRays += raysPerHit;
 		}
+		shadowQueue.resize(shadowRays);
+		shadowOrder.resize(shadowRays);
+
+		// Shade the hits into shadow rays
+		tilePool.For(packets * R, R, [&]( int begin, int end )
+		{
+			for(int q = begin; q < end; q++)
+			{
+				PrimaryRay& ray = primaryQueue[q];
+				if(ray.shadowFirst < 0)
+					continue;
+
+				int first = ray.shadowFirst;
+				FillIntersection(cameraPos, ray.hit, ray.intersection);
+				ray.color = HitTriangle(ray.intersection).color;
+				ray.normal = glm::normalize(SurfaceNormal(ray.intersection));
+				if(ray.baked)
+					continue;
+				for(int j = 0; j < raysPerHit; j++)
+				{
+					ShadowRay& shadow = shadowQueue[first + j];
+					int light = j / lightSamples;
+					if(lightTreeInUse)
+					{
+						int slot;
+						shadow = TreeLightSample(ray.intersection.position, ray.normal, j, slot, ray.rotation);
+						light = slot / SOFT_SHADOWS_SAMPLES;
+					}
+					else
+						shadow = LightSample(ray.intersection.position, ray.normal, j / lightSamples, j % lightSamples, lightSamples, ray.rotation);
+					if(shadow.contribution == vec3(0.0f))
+						shadowOrder[first + j] = SKIPPED | (first + j);
+					else
+						shadowOrder[first + j] = ((uint64_t) ShadowKey(light, shadow.dir) << 32) | (first + j);
+				}
+			}
+		});
+
+		// Sort the shadow rays and test the ones that matter, clearing the light of the blocked ones
+		RadixSort(shadowOrder, shadowScratch, 32, SHADOW_KEY_BITS);
+		int traced = std::lower_bound(shadowOrder.begin(), shadowOrder.end(), SKIPPED) - shadowOrder.begin();
+
+		tilePool.For(traced, 256, [&]( int begin, int end )
+		{
+			for(int o = begin; o < end; o++)
+			{
+				ShadowRay& shadow = shadowQueue[shadowOrder[o] & 0xffffffffull];
+				if(Occluded(shadow.origin, shadow.dir, 0.0f, shadow.tMax))
+					shadow.contribution = vec3(0.0f);
+			}
+		});
+
+		// Add up the light reaching each sample in the same order as DirectLight and Shade
+		tilePool.For(waveEnd - waveStart, 1, [&]( int begin, int end )
+		{
+			for(int block = waveStart + begin; block < waveStart + end; block++)
+			{
+				int xStart = (block % blocksX) * B;
+				int yStart = (block / blocksX) * B;
+				int width = min(xStart + B, SCREEN_WIDTH) - xStart;
+				int height = min(yStart + B, SCREEN_HEIGHT) - yStart;
+
+				for(int r = 0; r < width * height; r++)
+				{
+					int x = xStart + r % width;
+					int y = yStart + r / width;
+					vec3 avgColor(0.0f,0.0f,0.0f);
+					for(int sample = 0; sample < samplesPerPixel; sample++)
+					{
+						const PrimaryRay& ray = primaryQueue[((block - waveStart) * samplesPerPixel + sample) * R + r];
+						GBufferSample& g = gBuffer[(y*SCREEN_HEIGHT + x)*samplesPerPixel + sample];
+						g.intersection.triangleIndex = -1;
+						if(ray.shadowFirst < 0)
+							continue;
+						g.intersection = ray.intersection;
+						g.normal = ray.normal;
+
+						vec3 direct(0.0f,0.0f,0.0f);
+						if(ray.baked)
+							direct = lightmap.Lookup(ray.intersection.triangleIndex, ray.intersection.u, ray.intersection.v);
+						for(int j = 0; j < raysPerHit && !ray.baked; j++)
+						{
+							const ShadowRay& shadow = shadowQueue[ray.shadowFirst + j];
+							if(shadow.contribution != vec3(0.0f))
+								direct += shadow.contribution;
+						}
+						avgColor += ray.color * (direct*ray.color + indirectLight);
+
+						closestIntersections[y*SCREEN_HEIGHT + x] = ray.intersection;
+						focalDistances[y*SCREEN_HEIGHT + x] = ray.intersection.distance - FOCAL_LENGTH;
+					}
+					pixelColours[y*SCREEN_HEIGHT + x] = avgColor / (float) samplesPerPixel;
+				}
+			}
+		});
 	}
+}
 
-	if( SDL_MUSTLOCK(screen) )
-		SDL_UnlockSurface(screen);
-		
+// Lights the primary hits kept in the G-buffer, adding up the samples of each pixel in the same
+// order as the other paths, for frames where only the lights changed
+void DrawLighting(int realSamples)
+{
+	int samplesPerPixel = realSamples * realSamples;
+	bool adaptive = AdaptiveAAInUse(realSamples);
 
-	SDL_UpdateRect( screen, 0, 0, 0, 0 );
+	tilePool.Run(SCREEN_WIDTH, SCREEN_HEIGHT, TILE_SIZE, [&]( const Tile& tile )
+	{
+		if(renderThread.Cancelled())
+			return;
+		for (int y = tile.y0; y < tile.y1; y++)
+		{
+			for (int x = tile.x0; x < tile.x1; x++)
+			{
+				// Pixels adaptive AA left alone only have their first sample
+				int samples = (adaptive && !edgePixels[y*SCREEN_HEIGHT + x]) ? 1 : samplesPerPixel;
+				vec3 avgColor(0.0f,0.0f,0.0f);
+				for(int sample = 0; sample < samples; sample++)
+				{
+					const GBufferSample& g = gBuffer[(y*SCREEN_HEIGHT + x)*samplesPerPixel + sample];
+					if(g.intersection.triangleIndex < 0)
+						continue;
+
+					// FOCAL_LENGTH may have changed since the hits were stored
+					focalDistances[y*SCREEN_HEIGHT + x] = g.intersection.distance - FOCAL_LENGTH;
+					avgColor += Shade(g.intersection, g.normal, SampleRotation(x, y, sample));
+				}
+				pixelColours[y*SCREEN_HEIGHT + x] = avgColor / (float) samples;
+			}
+		}
+	});
+}
+
+// Rasterises the primary visibility of every sample into visibilityBuffer instead of tracing primary
+// rays, fills the G-buffer with the exact hits on the visible triangles and lights it from there
+void DrawHybrid(int realSamples)
+{
+	int samplesPerPixel = realSamples * realSamples;
+	float step = (realSamples > 1) ? 1.0f / (float) (realSamples - 1) : 0.0f;
+
+	for(int z = 0; z < realSamples; z++)
+	{
+		for(int z2 = 0; z2 < realSamples && !renderThread.Cancelled(); z2++)
+		{
+			// Same sample offsets within the pixel as the other paths
+			float ox = (realSamples > 1) ? z2*step - 0.5f : 0.0f;
+			float oy = (realSamples > 1) ? z*step - 0.5f : 0.0f;
+
+			visibilityBuffer.Begin(SCREEN_WIDTH, SCREEN_HEIGHT, focalLength, cameraPos, cameraRot, ox, oy);
+			visibilityBuffer.AddTriangles(tilePool, triangles);
+			for(size_t i = 0; i < instancedScene.instances.size(); i++)
+			{
+				const Instance& instance = instancedScene.instances[i];
+				visibilityBuffer.AddTriangles(tilePool, instancedScene.meshes[instance.mesh].triangles, i, &instance.transform);
+			}
+			visibilityBuffer.Rasterise(tilePool);
+
+			tilePool.Run(SCREEN_WIDTH, SCREEN_HEIGHT, TILE_SIZE, [&]( const Tile& tile )
+			{
+				if(renderThread.Cancelled())
+					return;
+				for (int y = tile.y0; y < tile.y1; y++)
+				{
+					for (int x = tile.x0; x < tile.x1; x++)
+					{
+						GBufferSample& g = gBuffer[(y*SCREEN_HEIGHT + x)*samplesPerPixel + z*realSamples + z2];
+						g.intersection.triangleIndex = -1;
+
+						int p = y*visibilityBuffer.width + x;
+						if(visibilityBuffer.triangle[p] < 0)
+							continue;
+
+						// Hit the one visible triangle with the pixel's primary ray, in object space for instances
+						Hit hit;
+						hit.triangleIndex = visibilityBuffer.triangle[p];
+						hit.instanceIndex = visibilityBuffer.instance[p];
+						vec3 start = cameraPos;
+						vec3 dir = cameraRot*vec3(x + ox - (float)SCREEN_WIDTH/2.0f, y + oy - (float)SCREEN_HEIGHT/2.0f, focalLength);
+						if(hit.instanceIndex >= 0)
+						{
+							const Instance& instance = instancedScene.instances[hit.instanceIndex];
+							start = vec3(instance.inverse * glm::vec4(start, 1.0f));
+							dir = vec3(instance.inverse * glm::vec4(dir, 0.0f));
+						}
+						Intersection& intersection = closestIntersections[y*SCREEN_HEIGHT + x];
+						intersection.triangleIndex = hit.triangleIndex;
+						intersection.instanceIndex = hit.instanceIndex;
+						const Triangle& triangle = HitTriangle(intersection);
+						vec3 e1 = triangle.v1 - triangle.v0;
+						vec3 e2 = triangle.v2 - triangle.v0;
+						TriangleStore::Cramer(triangle.v0, e1, e2, glm::cross(e1, e2), start, dir, hit.t, hit.u, hit.v);
+
+						FillIntersection(cameraPos, hit, intersection);
+						focalDistances[y*SCREEN_HEIGHT + x] = intersection.distance - FOCAL_LENGTH;
+						g.intersection = intersection;
+						g.normal = glm::normalize(SurfaceNormal(intersection));
+					}
+				}
+			});
+		}
+	}
+
+	DrawLighting(realSamples);
+}
 
+// Stable sort of values by bits [firstBit, firstBit + bits), 8 bits per counting pass. The values
+// are cut into fixed chunks and the pool counts the digits of each chunk. A scan over the counts,
+// digit by digit and chunk by chunk within a digit, gives every chunk where to write each of its
+// digits. Chunks are in order, so equal keys keep their order however the chunks are shared out
+void RadixSort(vector<uint64_t>& values, vector<uint64_t>& scratch, int firstBit, int bits)
+{
+	const int CHUNK = 16384;
+	int n = values.size();
+	int chunks = (n + CHUNK - 1) / CHUNK;
+	scratch.resize(n);
+	vector<size_t> offsets(256 * chunks);
+
+	for(int shift = firstBit; shift < firstBit + bits; shift += 8)
+	{
+		tilePool.For(chunks, 1, [&]( int begin, int end )
+		{
+			for(int k = begin; k < end; k++)
+			{
+				size_t* own = &offsets[256 * k];
+				std::fill(own, own + 256, 0);
+				for(int i = k * CHUNK; i < min(n, (k + 1) * CHUNK); i++)
+					own[(values[i] >> shift) & 0xff]++;
+			}
+		});
+
+		size_t sum = 0;
+		for(int b = 0; b < 256; b++)
+		{
+			for(int k = 0; k < chunks; k++)
+			{
+				size_t count = offsets[256 * k + b];
+				offsets[256 * k + b] = sum;
+				sum += count;
+			}
+		}
+
+		tilePool.For(chunks, 1, [&]( int begin, int end )
+		{
+			for(int k = begin; k < end; k++)
+			{
+				size_t* own = &offsets[256 * k];
+				for(int i = k * CHUNK; i < min(n, (k + 1) * CHUNK); i++)
+					scratch[own[(values[i] >> shift) & 0xff]++] = values[i];
+			}
+		});
+		values.swap(scratch);
+	}
+}
+
+// Sort key binning a shadow ray by the light it comes from and its direction. The direction is
+// folded onto an octahedron and unfolded into a square of SHADOW_BUCKETS x SHADOW_BUCKETS
+// buckets, which covers the sphere far more evenly than quantising x, y and z. Buckets are
+// numbered in Morton order so neighbouring buckets also sort close together
+uint32_t ShadowKey(int light, vec3 dir)
+{
+	float l = fabsf(dir.x) + fabsf(dir.y) + fabsf(dir.z);
+	float u = dir.x / l;
+	float v = dir.y / l;
+	if(dir.z < 0.0f)
+	{
+		float fu = (1.0f - fabsf(v)) * (u < 0.0f ? -1.0f : 1.0f);
+		float fv = (1.0f - fabsf(u)) * (v < 0.0f ? -1.0f : 1.0f);
+		u = fu;
+		v = fv;
+	}
+
+	uint32_t bu = min(SHADOW_BUCKETS - 1, max(0, (int)((u + 1.0f) * 0.5f * SHADOW_BUCKETS)));
+	uint32_t bv = min(SHADOW_BUCKETS - 1, max(0, (int)((v + 1.0f) * 0.5f * SHADOW_BUCKETS)));
+	uint32_t bucket = 0;
+	int bits = 0;
+	for(int bit = 0; (1 << bit) < SHADOW_BUCKETS; bit++, bits += 2)
+		bucket |= (((bu >> bit) & 1) << (2*bit)) | (((bv >> bit) & 1) << (2*bit + 1));
+
+	// The light has the bits above the bucket. Lights past the last but one share the last bin,
+	// as an all ones key would sort level with the SKIPPED rays and could be cut off with them
+	light = min(light, (1 << (SHADOW_KEY_BITS - bits)) - 2);
+	return ((uint32_t) light << bits) | bucket;
+}
+
+// Blurs pixelColours into blurredPixels, ready to be shown
+void CalculateDOF()
+{
+	// Total number of pixels in the kernel
+	float totalPixels = DOF_KERNEL_SIZE * DOF_KERNEL_SIZE;
+
+	// The pixels on the edge of the screen are left out
+	tilePool.Run(SCREEN_WIDTH, SCREEN_HEIGHT, TILE_SIZE, [&]( const Tile& tile )
+	{
+		if(renderThread.Cancelled())
+			return;
+		for (int y = max(tile.y0, 1); y < min(tile.y1, SCREEN_HEIGHT - 1); y++)
+		{
+			for (int x = max(tile.x0, 1); x < min(tile.x1, SCREEN_WIDTH - 1); x++)
+			{
+				vec3 finalColour(0.0f,0.0f,0.0f);
+				if(DOF_ENABLED)
+				{
+					// Start from top left of kernel
+					for(int z = ceil(DOF_KERNEL_SIZE / -2.0f); z < ceil(DOF_KERNEL_SIZE / 2.0f); z++)
+					{
+						for(int z2 = ceil(DOF_KERNEL_SIZE / -2.0f); z2 < ceil(DOF_KERNEL_SIZE / 2.0f); z2++)
+						{
+							float weighting;
+							if(z == 0 && z2 == 0)
+								weighting = 1 - (min(abs(focalDistances[y*SCREEN_HEIGHT+x]), 1.0f) * ((totalPixels - 1) / totalPixels) );
+							else
+								weighting = min(abs(focalDistances[y*SCREEN_HEIGHT+x]), 1.0f) * (1.0f / totalPixels);
+
+							// Add contribution to final pixel colour
+							finalColour += pixelColours[(y+z)*SCREEN_HEIGHT+(x+z2)] * weighting;
+						}
+					}
+				}
+				else
+				{
+					finalColour = pixelColours[y*SCREEN_HEIGHT+x];
+				}
+
+				blurredPixels[y*SCREEN_HEIGHT+x] = finalColour;
+			}
+		}
+	});
 }